@@ -8,70 +8,892 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "hw/boards.h"
 #include "hw/qdev-properties.h"
 #include "hw/arm/boot.h"
+#include "hw/loader.h"
+#include "elf.h"
 #include "exec/address-spaces.h"
+#include "qemu/bitmap.h"
+#include "qemu/error-report.h"
+#include "sysemu/reset.h"
+#include "sysemu/runstate.h"
+#include "exec/exec-all.h"
+#include "hw/core/cpu.h"
 #include "hw/arm/rp2040.h"
+#include "cpu.h"
 
 #define TYPE_PICO_MACHINE MACHINE_TYPE_NAME("raspberrypi-pico")
 OBJECT_DECLARE_SIMPLE_TYPE(PicoMachineState, PICO_MACHINE)
 
+/*
+ * The second-stage bootloader at the start of an SDK flash image, ending
+ * in a CRC32 of the rest that the boot ROM checks before running it
+ */
+#define PICO_BOOT2_SIZE 256
+#define PICO_BOOT2_CRC_OFFSET (PICO_BOOT2_SIZE - 4)
+
+/*
+ * Hang detection: a core whose PC samples stay within this many bytes
+ * is spinning rather than making progress.  QEMU exits with the status
+ * timeout(1) uses, so runners treat a hang like a timeout.
+ */
+#define PICO_HANG_PC_WINDOW     256
+#define PICO_HANG_SAMPLES       8       /* PC samples per hang-timeout */
+#define PICO_HANG_EXIT          124
+
+/* UF2 blocks, see https://github.com/microsoft/uf2 */
+#define UF2_BLOCK_SIZE          512
+#define UF2_MAGIC_START0        0x0A324655
+#define UF2_MAGIC_START1        0x9E5D5157
+#define UF2_MAGIC_END           0x0AB16F30
+#define UF2_FLAG_NOT_MAIN_FLASH 0x00000001
+#define UF2_FLAG_FAMILY_ID      0x00002000
+#define UF2_MAX_PAYLOAD         476
+#define UF2_FAMILY_RP2040       0xE48BFF56
+
+typedef struct UF2Block {
+    uint32_t magic_start0;
+    uint32_t magic_start1;
+    uint32_t flags;
+    uint32_t target_addr;
+    uint32_t payload_size;
+    uint32_t block_no;
+    uint32_t num_blocks;
+    uint32_t family_id;     /* file size without UF2_FLAG_FAMILY_ID */
+    uint8_t data[UF2_MAX_PAYLOAD];
+    uint32_t magic_end;
+} UF2Block;
+
+QEMU_BUILD_BUG_ON(sizeof(UF2Block) != UF2_BLOCK_SIZE);
+
+/* PCs sampled from one core since it last made progress */
+typedef struct PicoHangCore {
+    uint32_t pc;            /* latest sample, taken on the vCPU */
+    bool sampled;
+    uint32_t lo, hi;        /* range of the samples */
+    bool seen;
+} PicoHangCore;
+
 typedef struct PicoMachineState {
     MachineState parent_obj;
     RP2040State soc;
+    
+    /* Hang detection, sampled by a scheduler watchdog event */
+    RP2040Event hang_event;
+    Notifier hang_rewind;
+    int64_t hang_progress_ns;   /* guest time of the last progress */
+    uint64_t hang_writes;       /* device writes seen at that time */
+    uint32_t hang_samples;      /* samples taken since */
+    PicoHangCore hang_core[RP2040_NUM_CORES];
+    
+    int64_t kernel_entry;   /* ELF entry point, or -1 */
+    bool sram_image;        /* the image runs from SRAM (no_flash) */
+    
+    uint32_t time_dilation;
+    bool realtime;
+    uint64_t flash_size;
+    char *flash_image;
+    bool fast_boot;
+    uint32_t test_runs;
+    char *test_run_serial;
+    uint32_t hang_timeout_ms;
 } PicoMachineState;
 
+static bool pico_is_code_addr(PicoMachineState *s, uint32_t addr)
+{
+    return (addr >= RP2040_XIP_BASE &&
+            addr < RP2040_XIP_BASE + s->flash_size) ||
+           (addr >= RP2040_SRAM_BASE &&
+            addr < RP2040_SRAM_BASE + RP2040_SRAM_SIZE);
+}
+
+/*
+ * Read the initial SP and reset vector at base and check that they look
+ * like a vector table.
+ */
+static bool pico_read_vectors(PicoMachineState *s, hwaddr base,
+                              uint32_t *sp, uint32_t *pc)
+{
+    uint8_t buf[8];
+    
+    if (address_space_read(&s->soc.loader_as, base, MEMTXATTRS_UNSPECIFIED,
+                           buf, sizeof(buf)) != MEMTX_OK) {
+        return false;
+    }
+    *sp = ldl_le_p(buf);
+    *pc = ldl_le_p(buf + 4);
+    
+    return *sp > RP2040_SRAM_BASE &&
+           *sp <= RP2040_SRAM_BASE + RP2040_SRAM_SIZE && !(*sp & 3) &&
+           (*pc & 1) && pico_is_code_addr(s, *pc & ~1);
+}
+
+/*
+ * Check the boot2 CRC the way the boot ROM does (CRC-32/MPEG-2: polynomial
+ * 0x04C11DB7, initial value 0xFFFFFFFF, no reflection, no final XOR), so a
+ * bare image is not mistaken for one with a vector table after boot2.
+ */
+static bool pico_boot2_valid(PicoMachineState *s)
+{
+    uint8_t buf[PICO_BOOT2_SIZE];
+    uint32_t crc = 0xFFFFFFFF;
+    int i, bit;
+    
+    if (address_space_read(&s->soc.loader_as, RP2040_XIP_BASE,
+                           MEMTXATTRS_UNSPECIFIED, buf,
+                           sizeof(buf)) != MEMTX_OK) {
+        return false;
+    }
+    for (i = 0; i < PICO_BOOT2_CRC_OFFSET; i++) {
+        crc ^= (uint32_t)buf[i] << 24;
+        for (bit = 0; bit < 8; bit++) {
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+        }
+    }
+    
+    return crc == ldl_le_p(buf + PICO_BOOT2_CRC_OFFSET);
+}
+
+/*
+ * Fast boot: instead of running the boot ROM and boot2, start core 0 the
+ * way boot2 leaves it, with VTOR, SP and PC taken from the image's vector
+ * table.  SDK flash images keep it after boot2, bare images at the start
+ * of flash and no_flash images at the start of SRAM.
+ */
+static void pico_fast_boot_reset(void *opaque)
+{
+    PicoMachineState *s = opaque;
+    hwaddr bases[] = {
+        RP2040_XIP_BASE + PICO_BOOT2_SIZE,
+        RP2040_XIP_BASE,
+        RP2040_SRAM_BASE,
+    };
+    int nbases = ARRAY_SIZE(bases);
+    CPUARMState *env;
+    uint32_t sp, pc;
+    int first, i;
+    
+    for (i = 0; i < s->soc.num_cpus; i++) {
+        cpu_reset(CPU(s->soc.cpu[i].cpu));
+    }
+    
+    /*
+     * The table after boot2 is only trusted behind a valid boot2, and a
+     * stale SRAM table only for an image that runs there.
+     */
+    first = pico_boot2_valid(s) ? 0 : 1;
+    if (!s->sram_image) {
+        nbases--;
+    }
+    for (i = first; i < nbases; i++) {
+        if (pico_read_vectors(s, bases[i], &sp, &pc)) {
+            break;
+        }
+    }
+    
+    env = &s->soc.cpu[0].cpu->env;
+    if (i < nbases) {
+        env->v7m.vecbase[M_REG_NS] = bases[i];
+    } else if (s->kernel_entry >= 0) {
+        sp = RP2040_SRAM_BASE + RP2040_SRAM_SIZE;
+        pc = s->kernel_entry | 1;
+    } else {
+        warn_report_once("raspberrypi-pico: fast-boot found no vector "
+                         "table; core 0 starts from the boot ROM");
+        return;
+    }
+    env->regs[13] = sp & ~3;
+    env->regs[15] = pc & ~1;
+    env->thumb = 1;
+    
+    /*
+     * Core 1 would wait in the boot ROM for the launch sequence on the SIO
+     * FIFO, which is not modelled, so it stays powered off: merely halted,
+     * the first interrupt would wake it at the reset PC of 0.
+     */
+    if (s->soc.num_cpus > 1) {
+        s->soc.cpu[1].cpu->power_state = PSCI_OFF;
+        CPU(s->soc.cpu[1].cpu)->halted = 1;
+    }
+}
+
+static bool pico_is_load_range(PicoMachineState *s, uint32_t addr,
+                               uint32_t size)
+{
+    uint64_t end = (uint64_t)addr + size;
+    
+    return (addr >= RP2040_XIP_BASE &&
+            end <= RP2040_XIP_BASE + s->flash_size) ||
+           (addr >= RP2040_SRAM_BASE &&
+            end <= RP2040_SRAM_BASE + RP2040_SRAM_SIZE);
+}
+
+static bool pico_is_uf2(const char *filename)
+{
+    uint32_t magic[2];
+    FILE *f = fopen(filename, "rb");
+    bool ret = false;
+    
+    if (f) {
+        ret = fread(magic, sizeof(magic), 1, f) == 1 &&
+              le32_to_cpu(magic[0]) == UF2_MAGIC_START0 &&
+              le32_to_cpu(magic[1]) == UF2_MAGIC_START1;
+        fclose(f);
+    }
+    
+    return ret;
+}
+
+/*
+ * Stream a UF2 file from its mapping straight into flash and SRAM, one
+ * block at a time, as the boot ROM does when the file is copied to the
+ * USB drive.  Blocks for other families or not meant for main flash are
+ * skipped; the RP2040 blocks must be numbered consistently and complete.
+ */
+static bool pico_load_uf2(PicoMachineState *s, const char *filename,
+                          Error **errp)
+{
+    GError *gerr = NULL;
+    GMappedFile *mapped;
+    const uint8_t *data;
+    size_t len, nfile;
+    unsigned long *seen = NULL;
+    uint32_t num_blocks = 0, loaded = 0;
+    uint32_t low = UINT32_MAX;
+    bool ok = false;
+    
+    mapped = g_mapped_file_new(filename, FALSE, &gerr);
+    if (!mapped) {
+        error_setg(errp, "Could not open UF2 '%s': %s", filename,
+                   gerr->message);
+        g_error_free(gerr);
+        return false;
+    }
+    data = (const uint8_t *)g_mapped_file_get_contents(mapped);
+    len = g_mapped_file_get_length(mapped);
+    
+    if (len % UF2_BLOCK_SIZE) {
+        error_setg(errp, "UF2 '%s': size is not a multiple of %d bytes",
+                   filename, UF2_BLOCK_SIZE);
+        goto out;
+    }
+    nfile = len / UF2_BLOCK_SIZE;
+    
+    for (size_t i = 0; i < nfile; i++) {
+        const UF2Block *b = (const UF2Block *)(data + i * UF2_BLOCK_SIZE);
+        uint32_t flags = le32_to_cpu(b->flags);
+        uint32_t addr, size, no, n;
+        
+        if (le32_to_cpu(b->magic_start0) != UF2_MAGIC_START0 ||
+            le32_to_cpu(b->magic_start1) != UF2_MAGIC_START1 ||
+            le32_to_cpu(b->magic_end) != UF2_MAGIC_END) {
+            error_setg(errp, "UF2 '%s': bad magic in block at offset %zu",
+                       filename, i * UF2_BLOCK_SIZE);
+            goto out;
+        }
+        if ((flags & UF2_FLAG_NOT_MAIN_FLASH) ||
+            ((flags & UF2_FLAG_FAMILY_ID) &&
+             le32_to_cpu(b->family_id) != UF2_FAMILY_RP2040)) {
+            continue;
+        }
+        
+        addr = le32_to_cpu(b->target_addr);
+        size = le32_to_cpu(b->payload_size);
+        no = le32_to_cpu(b->block_no);
+        n = le32_to_cpu(b->num_blocks);
+        
+        if (!seen) {
+            if (n == 0 || n > nfile) {
+                error_setg(errp, "UF2 '%s': image of %u blocks in a file "
+                           "of %zu blocks", filename, n, nfile);
+                goto out;
+            }
+            num_blocks = n;
+            seen = bitmap_new(num_blocks);
+        }
+        if (n != num_blocks || no >= num_blocks) {
+            error_setg(errp, "UF2 '%s': block %u of %u does not belong to "
+                       "a %u-block image", filename, no, n, num_blocks);
+            goto out;
+        }
+        if (test_and_set_bit(no, seen)) {
+            error_setg(errp, "UF2 '%s': block %u appears twice",
+                       filename, no);
+            goto out;
+        }
+        if (size > UF2_MAX_PAYLOAD || !pico_is_load_range(s, addr, size)) {
+            error_setg(errp, "UF2 '%s': block %u targets 0x%08x+%u, "
+                       "outside flash and SRAM", filename, no, addr, size);
+            goto out;
+        }
+        
+        if (address_space_write(&s->soc.loader_as, addr,
+                                MEMTXATTRS_UNSPECIFIED, b->data,
+                                size) != MEMTX_OK) {
+            error_setg(errp, "UF2 '%s': could not write block %u",
+                       filename, no);
+            goto out;
+        }
+        low = MIN(low, addr);
+        loaded++;
+    }
+    
+    if (!seen) {
+        error_setg(errp, "UF2 '%s': no RP2040 blocks", filename);
+        goto out;
+    }
+    if (loaded != num_blocks) {
+        error_setg(errp, "UF2 '%s': %u of %u blocks missing",
+                   filename, num_blocks - loaded, num_blocks);
+        goto out;
+    }
+    
+    s->sram_image = low >= RP2040_SRAM_BASE;
+    ok = true;
+    
+out:
+    g_free(seen);
+    g_mapped_file_unref(mapped);
+    return ok;
+}
+
+/*
+ * Load a UF2, ELF or raw flash image.  Everything is written straight to
+ * memory rather than registered as ROM blobs, which can only be added
+ * before the machine starts and would be rewritten on every reset: the
+ * same path serves start-up and reload.
+ */
+static bool pico_load_image(PicoMachineState *s, const char *filename,
+                            Error **errp)
+{
+    g_autofree char *data = NULL;
+    uint64_t entry, lowaddr, highaddr;
+    GError *gerr = NULL;
+    gsize len;
+    
+    s->kernel_entry = -1;
+    s->sram_image = false;
+    
+    if (pico_is_uf2(filename)) {
+        return pico_load_uf2(s, filename, errp);
+    }
+    
+    if (load_elf_ram_sym(filename, NULL, NULL, NULL, &entry, &lowaddr,
+                         &highaddr, NULL, 0, EM_ARM, 1, 0,
+                         &s->soc.loader_as, false, NULL) >= 0) {
+        s->kernel_entry = entry;
+        s->sram_image = entry >= RP2040_SRAM_BASE;
+        return true;
+    }
+    
+    /* Anything else is a raw image for the start of flash */
+    if (!g_file_get_contents(filename, &data, &len, &gerr)) {
+        error_setg(errp, "Could not load image '%s': %s", filename,
+                   gerr->message);
+        g_error_free(gerr);
+        return false;
+    }
+    if (len > s->flash_size) {
+        error_setg(errp, "Image '%s' of %zu bytes does not fit in %" PRIu64
+                   " bytes of flash", filename, (size_t)len, s->flash_size);
+        return false;
+    }
+    if (address_space_write(&s->soc.loader_as, RP2040_XIP_BASE,
+                            MEMTXATTRS_UNSPECIFIED, data,
+                            len) != MEMTX_OK) {
+        error_setg(errp, "Could not write image '%s' to flash", filename);
+        return false;
+    }
+    
+    return true;
+}
+
+static void pico_hang_sample_cpu(CPUState *cs, run_on_cpu_data data)
+{
+    PicoHangCore *core = data.host_ptr;
+    
+    /* Run on the vCPU between TBs, so the PC is up to date */
+    core->pc = ARM_CPU(cs)->env.regs[15];
+    core->sampled = true;
+}
+
+static void pico_hang_report(PicoMachineState *s, int64_t now)
+{
+    vm_stop(RUN_STATE_PAUSED);
+    
+    error_report("raspberrypi-pico: no progress for %" PRId64 " ms of "
+                 "guest time, stopping", (now - s->hang_progress_ns) /
+                 SCALE_MS);
+    for (int i = 0; i < s->soc.num_cpus; i++) {
+        PicoHangCore *core = &s->hang_core[i];
+        
+        if (core->seen) {
+            error_printf("core %d: PC within 0x%08x..0x%08x over the last "
+                         "%u samples\n", i, core->lo, core->hi,
+                         s->hang_samples);
+        }
+        cpu_dump_state(CPU(s->soc.cpu[i].cpu), stderr, 0);
+    }
+    rp2040_sched_dump_writes(&s->soc.sched);
+    
+    qemu_system_shutdown_request_with_code(SHUTDOWN_CAUSE_GUEST_PANIC,
+                                           PICO_HANG_EXIT);
+}
+
+/*
+ * The guest makes progress when it writes a device register, UART output
+ * included, or when a core's PC leaves a small window.  Without either
+ * for hang-timeout of guest time, the run is stopped with a dump.
+ */
+static void pico_hang_check(void *opaque)
+{
+    PicoMachineState *s = opaque;
+    RP2040SchedState *sched = &s->soc.sched;
+    int64_t period = (int64_t)s->hang_timeout_ms * SCALE_MS /
+                     PICO_HANG_SAMPLES;
+    int64_t now = rp2040_sched_now_ns(sched);
+    bool progress = sched->writes != s->hang_writes;
+    
+    for (int i = 0; i < s->soc.num_cpus; i++) {
+        PicoHangCore *core = &s->hang_core[i];
+        
+        if (!core->sampled) {
+            continue;
+        }
+        if (!core->seen) {
+            core->lo = core->hi = core->pc;
+            core->seen = true;
+        }
+        core->lo = MIN(core->lo, core->pc);
+        core->hi = MAX(core->hi, core->pc);
+        if (core->hi - core->lo > PICO_HANG_PC_WINDOW) {
+            progress = true;
+        }
+    }
+    s->hang_samples++;
+    
+    if (progress) {
+        s->hang_progress_ns = now;
+        s->hang_writes = sched->writes;
+        s->hang_samples = 0;
+        for (int i = 0; i < s->soc.num_cpus; i++) {
+            s->hang_core[i].seen = false;
+        }
+    } else if (now - s->hang_progress_ns >=
+               (int64_t)s->hang_timeout_ms * SCALE_MS) {
+        pico_hang_report(s, now);
+        return;
+    }
+    
+    for (int i = 0; i < s->soc.num_cpus; i++) {
+        s->hang_core[i].sampled = false;
+        async_run_on_cpu(CPU(s->soc.cpu[i].cpu), pico_hang_sample_cpu,
+                         RUN_ON_CPU_HOST_PTR(&s->hang_core[i]));
+    }
+    rp2040_event_mod(&s->hang_event, now + period);
+}
+
+/*
+ * Count from now: after a reset, a reload or a test rewind, which moves
+ * guest time back under the absolute deadline of the next sample.
+ */
+static void pico_hang_restart(PicoMachineState *s)
+{
+    RP2040SchedState *sched = &s->soc.sched;
+    int64_t now = rp2040_sched_now_ns(sched);
+    
+    if (!s->hang_timeout_ms) {
+        return;
+    }
+    
+    s->hang_progress_ns = now;
+    s->hang_writes = sched->writes;
+    s->hang_samples = 0;
+    for (int i = 0; i < s->soc.num_cpus; i++) {
+        s->hang_core[i].seen = false;
+        s->hang_core[i].sampled = false;
+    }
+    rp2040_event_mod(&s->hang_event, now + (int64_t)s->hang_timeout_ms *
+                     SCALE_MS / PICO_HANG_SAMPLES);
+}
+
+static void pico_hang_reset(void *opaque)
+{
+    pico_hang_restart(opaque);
+}
+
+static void pico_hang_rewind_notify(Notifier *notifier, void *data)
+{
+    pico_hang_restart(container_of(notifier, PicoMachineState, hang_rewind));
+}
+
+static int pico_reset_device(Object *child, void *opaque)
+{
+    if (object_dynamic_cast(child, TYPE_DEVICE)) {
+        device_cold_reset(DEVICE(child));
+    }
+    return 0;
+}
+
+/*
+ * Swap in a new image without restarting QEMU: erase flash and SRAM, load
+ * the image and reset the SoC's devices and cores, the expect scripts of
+ * the UARTs with them, and the hang detector.  Chardevs, the monitor and
+ * GDB connections are not touched.  Set through QMP with
+ * qom-set /machine reload <path>.
+ */
+static void pico_set_reload(Object *obj, const char *value, Error **errp)
+{
+    ERRP_GUARD();
+    PicoMachineState *s = PICO_MACHINE(obj);
+    MemoryRegion *ram[] = { &s->soc.xip, &s->soc.sram };
+    bool running = runstate_is_running();
+    
+    if (!DEVICE(&s->soc)->realized) {
+        error_setg(errp, "reload is only possible on a running machine");
+        return;
+    }
+    
+    vm_stop(RUN_STATE_PAUSED);
+    
+    /*
+     * Erased flash reads as 0xFF.  A flash image instead goes back to the
+     * file's contents: dropping the pages the guest has written keeps the
+     * rest shared with the page cache, which overwriting all of it would
+     * not.  The image is then loaded over it, copying only its own pages.
+     */
+    for (int i = 0; i < ARRAY_SIZE(ram); i++) {
+        void *ptr = memory_region_get_ram_ptr(ram[i]);
+        uint64_t size = memory_region_size(ram[i]);
+        
+        if (ram[i] != &s->soc.xip) {
+            memset(ptr, 0, size);
+        } else if (!s->flash_image) {
+            memset(ptr, 0xFF, size);
+        } else if (qemu_madvise(ptr, size, QEMU_MADV_DONTNEED) < 0) {
+            error_setg_errno(errp, errno, "Could not restore flash from "
+                             "'%s'", s->flash_image);
+            error_append_hint(errp, "The machine stays paused.\n");
+            return;
+        }
+        memory_region_set_dirty(ram[i], 0, size);
+    }
+    if (!pico_load_image(s, value, errp)) {
+        error_append_hint(errp, "The machine stays paused with flash and "
+                          "SRAM erased.\n");
+        return;
+    }
+    
+    object_child_foreach_recursive(OBJECT(&s->soc), pico_reset_device, NULL);
+    if (s->fast_boot) {
+        pico_fast_boot_reset(s);
+    }
+    pico_hang_restart(s);
+    tb_flush(first_cpu);
+    
+    if (running) {
+        vm_start();
+    }
+}
+
 static void pico_init(MachineState *machine)
 {
     PicoMachineState *s = PICO_MACHINE(machine);
     
     /* Initialize SoC */
     object_initialize_child(OBJECT(machine), "soc", &s->soc, TYPE_RP2040_SOC);
+    qdev_prop_set_uint32(DEVICE(&s->soc), "time-dilation", s->time_dilation);
+    qdev_prop_set_bit(DEVICE(&s->soc), "realtime", s->realtime);
+    qdev_prop_set_uint32(DEVICE(&s->soc), "flash-size", s->flash_size);
+    if (s->flash_image) {
+        qdev_prop_set_string(DEVICE(&s->soc), "flash-image", s->flash_image);
+    }
+    qdev_prop_set_uint32(DEVICE(&s->soc.testctl), "runs", s->test_runs);
+    if (s->test_run_serial) {
+        qdev_prop_set_string(DEVICE(&s->soc.testctl), "run-serial",
+                             s->test_run_serial);
+    }
     qdev_realize(DEVICE(&s->soc), NULL, &error_fatal);
     
-    /* Load firmware if provided */
+    /*
+     * Load firmware if provided.  The loaders write through the SoC's
+     * loader address space, which reaches the flash even when the XIP
+     * window in front of it is the cache model.
+     */
     if (machine->firmware) {
-        /* Load firmware to XIP flash region */
-        if (load_image_targphys(machine->firmware, 
-                               RP2040_XIP_BASE, 
-                               RP2040_XIP_SIZE) < 0) {
-            error_report("Could not load firmware '%s'", machine->firmware);
-            exit(1);
-        }
+        pico_load_image(s, machine->firmware, &error_fatal);
     } else if (machine->kernel_filename) {
-        /* Load kernel (ELF or binary) */
-        uint64_t entry, lowaddr, highaddr;
-        int kernel_size;
-        
-        kernel_size = load_elf(machine->kernel_filename, NULL, NULL, NULL,
-                              &entry, &lowaddr, &highaddr, NULL,
-                              0, EM_ARM, 1, 0);
-        
-        if (kernel_size < 0) {
-            /* Try loading as raw binary to XIP region */
-            kernel_size = load_image_targphys(machine->kernel_filename,
-                                             RP2040_XIP_BASE,
-                                             RP2040_XIP_SIZE);
-            if (kernel_size < 0) {
-                error_report("Could not load kernel '%s'", 
-                            machine->kernel_filename);
-                exit(1);
-            }
-        }
+        pico_load_image(s, machine->kernel_filename, &error_fatal);
+    }
+    
+    if (s->fast_boot) {
+        qemu_register_reset(pico_fast_boot_reset, s);
+    }
+    
+    /*
+     * The hang detector only watches: fast-forward does not skip idle
+     * time to its samples, so it cannot hurry a run to its own end.
+     */
+    if (s->hang_timeout_ms) {
+        rp2040_event_init_watchdog(&s->hang_event, &s->soc.sched,
+                                   pico_hang_check, s);
+        s->hang_rewind.notify = pico_hang_rewind_notify;
+        rp2040_sched_add_rewind_notifier(&s->soc.sched, &s->hang_rewind);
+        qemu_register_reset(pico_hang_reset, s);
+        pico_hang_restart(s);
+    }
+}
+
+static void pico_get_time_dilation(Object *obj, Visitor *v, const char *name,
+                                   void *opaque, Error **errp)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    
+    visit_type_uint32(v, name, &s->time_dilation, errp);
+}
+
+static void pico_set_time_dilation(Object *obj, Visitor *v, const char *name,
+                                   void *opaque, Error **errp)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    uint32_t value;
+    
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value == 0) {
+        error_setg(errp, "time-dilation must be at least 1");
+        return;
+    }
+    s->time_dilation = value;
+}
+
+static bool pico_get_realtime(Object *obj, Error **errp)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    
+    return s->realtime;
+}
+
+static void pico_set_realtime(Object *obj, bool value, Error **errp)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    
+    s->realtime = value;
+}
+
+static void pico_get_flash_size(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    
+    visit_type_size(v, name, &s->flash_size, errp);
+}
+
+static void pico_set_flash_size(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    uint64_t value;
+    
+    if (!visit_type_size(v, name, &value, errp)) {
+        return;
+    }
+    if (value == 0 || value > RP2040_XIP_SIZE ||
+        value % RP2040_FLASH_SECTOR_SIZE) {
+        error_setg(errp, "flash-size must be a multiple of %d bytes "
+                   "and at most %d bytes",
+                   RP2040_FLASH_SECTOR_SIZE, RP2040_XIP_SIZE);
+        return;
+    }
+    s->flash_size = value;
+}
+
+static char *pico_get_flash_image(Object *obj, Error **errp)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    
+    return g_strdup(s->flash_image);
+}
+
+static void pico_set_flash_image(Object *obj, const char *value, Error **errp)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    
+    g_free(s->flash_image);
+    s->flash_image = g_strdup(value);
+}
+
+static bool pico_get_fast_boot(Object *obj, Error **errp)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    
+    return s->fast_boot;
+}
+
+static void pico_set_fast_boot(Object *obj, bool value, Error **errp)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    
+    s->fast_boot = value;
+}
+
+static void pico_get_test_runs(Object *obj, Visitor *v, const char *name,
+                               void *opaque, Error **errp)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    
+    visit_type_uint32(v, name, &s->test_runs, errp);
+}
+
+static void pico_set_test_runs(Object *obj, Visitor *v, const char *name,
+                               void *opaque, Error **errp)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    uint32_t value;
+    
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value == 0) {
+        error_setg(errp, "test-runs must be at least 1");
+        return;
     }
+    s->test_runs = value;
+}
+
+static char *pico_get_test_run_serial(Object *obj, Error **errp)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
     
-    /* TODO: Set up boot ROM if needed */
+    return g_strdup(s->test_run_serial);
 }
 
-static void pico_machine_init(MachineClass *mc)
+static void pico_set_test_run_serial(Object *obj, const char *value,
+                                     Error **errp)
 {
+    PicoMachineState *s = PICO_MACHINE(obj);
+    
+    g_free(s->test_run_serial);
+    s->test_run_serial = g_strdup(value);
+}
+
+static void pico_get_hang_timeout(Object *obj, Visitor *v, const char *name,
+                                  void *opaque, Error **errp)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    
+    visit_type_uint32(v, name, &s->hang_timeout_ms, errp);
+}
+
+static void pico_set_hang_timeout(Object *obj, Visitor *v, const char *name,
+                                  void *opaque, Error **errp)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    
+    visit_type_uint32(v, name, &s->hang_timeout_ms, errp);
+}
+
+static void pico_machine_instance_init(Object *obj)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    
+    s->kernel_entry = -1;
+    s->time_dilation = 1;
+    s->flash_size = RP2040_FLASH_SIZE_DEFAULT;
+    s->fast_boot = true;
+    s->test_runs = 1;
+}
+
+static void pico_machine_instance_finalize(Object *obj)
+{
+    PicoMachineState *s = PICO_MACHINE(obj);
+    
+    g_free(s->flash_image);
+    g_free(s->test_run_serial);
+}
+
+static void pico_machine_class_init(ObjectClass *oc, void *data)
+{
+    MachineClass *mc = MACHINE_CLASS(oc);
+    
     mc->desc = "Raspberry Pi Pico (RP2040)";
     mc->init = pico_init;
     mc->max_cpus = 2;
     mc->default_cpus = 2;
     mc->default_ram_size = 264 * 1024;  /* 264KB SRAM */
     mc->default_ram_id = "rp2040.sram";
+    
+    object_class_property_add(oc, "time-dilation", "uint32",
+                              pico_get_time_dilation, pico_set_time_dilation,
+                              NULL, NULL);
+    object_class_property_set_description(oc, "time-dilation",
+        "Run guest time at this multiple of host time (default 1)");
+    
+    object_class_property_add_bool(oc, "realtime",
+                                   pico_get_realtime, pico_set_realtime);
+    object_class_property_set_description(oc, "realtime",
+        "Run guest time on the host wall clock, even while the VM is "
+        "paused (default off)");
+    
+    object_class_property_add(oc, "flash-size", "size",
+                              pico_get_flash_size, pico_set_flash_size,
+                              NULL, NULL);
+    object_class_property_set_description(oc, "flash-size",
+        "Size of the QSPI flash behind XIP (default 2M)");
+    
+    object_class_property_add_str(oc, "flash-image",
+                                  pico_get_flash_image, pico_set_flash_image);
+    object_class_property_set_description(oc, "flash-image",
+        "Full flash image file to map copy-on-write as XIP flash");
+    
+    object_class_property_add_bool(oc, "fast-boot",
+                                   pico_get_fast_boot, pico_set_fast_boot);
+    object_class_property_set_description(oc, "fast-boot",
+        "Start core 0 from the image's vector table, skipping the boot ROM "
+        "and boot2 (default on)");
+    
+    object_class_property_add_str(oc, "reload", NULL, pico_set_reload);
+    object_class_property_set_description(oc, "reload",
+        "Load a new UF2, ELF or raw image into the running machine and "
+        "reset the SoC");
+    
+    object_class_property_add(oc, "hang-timeout", "uint32",
+                              pico_get_hang_timeout, pico_set_hang_timeout,
+                              NULL, NULL);
+    object_class_property_set_description(oc, "hang-timeout",
+        "Stop with a dump and exit status 124 after this many ms of guest "
+        "time without progress (default 0, off)");
+    
+    object_class_property_add(oc, "test-runs", "uint32",
+                              pico_get_test_runs, pico_set_test_runs,
+                              NULL, NULL);
+    object_class_property_set_description(oc, "test-runs",
+        "Runs made from the test control checkpoint before exiting "
+        "(default 1)");
+    
+    object_class_property_add_str(oc, "test-run-serial",
+                                  pico_get_test_run_serial,
+                                  pico_set_test_run_serial);
+    object_class_property_set_description(oc, "test-run-serial",
+        "Chardev for UART0 in each run, with %u for the run index, "
+        "e.g. file:run-%u.log");
+}
+
+static const TypeInfo pico_machine_info = {
+    .name          = TYPE_PICO_MACHINE,
+    .parent        = TYPE_MACHINE,
+    .instance_size = sizeof(PicoMachineState),
+    .instance_init = pico_machine_instance_init,
+    .instance_finalize = pico_machine_instance_finalize,
+    .class_init    = pico_machine_class_init,
+};
+
+static void pico_machine_register_types(void)
+{
+    type_register_static(&pico_machine_info);
 }
 
-DEFINE_MACHINE("raspberrypi-pico", pico_machine_init)
\ No newline at end of file
+type_init(pico_machine_register_types)
\ No newline at end of file
@@ -16,25 +16,9 @@
 #include "hw/sysbus.h"
 #include "hw/qdev-properties.h"
 #include "sysemu/sysemu.h"
-#include "hw/char/rp2040_uart.h"
-#include "hw/gpio/rp2040_gpio.h"
-#include "hw/timer/rp2040_timer.h"
-
-#define TYPE_RP2040_SOC "rp2040-soc"
-OBJECT_DECLARE_SIMPLE_TYPE(RP2040State, RP2040_SOC)
-
-#define RP2040_NUM_CORES 2
-
-/* Memory map from RP2040 datasheet */
-#define RP2040_ROM_BASE         0x00000000
-#define RP2040_ROM_SIZE         (16 * 1024)  /* 16KB */
-
-#define RP2040_XIP_BASE         0x10000000
-#define RP2040_XIP_SIZE         (16 * 1024 * 1024)  /* 16MB max */
-
-#define RP2040_SRAM_BASE        0x20000000
-#define RP2040_SRAM_SIZE        (264 * 1024)  /* 264KB total */
+#include "hw/arm/rp2040.h"
 
+/* Memory map from RP2040 datasheet; ROM, XIP and SRAM are in rp2040.h */
 #define RP2040_APB_BASE         0x40000000
 #define RP2040_AHB_BASE         0x50000000
 
@@ -68,6 +52,7 @@ OBJECT_DECLARE_SIMPLE_TYPE(RP2040State, RP2040_SOC)
 #define RP2040_RTC_BASE         0x4005C000
 #define RP2040_ROSC_BASE        0x40060000
 #define RP2040_VREG_CHIP_RESET_BASE 0x40064000
+#define RP2040_TESTCTL_BASE     0x40068000  /* unused slot, QEMU only */
 #define RP2040_TBMAN_BASE       0x4006C000
 
 /* AHB-Lite Peripherals */
@@ -105,24 +90,6 @@ OBJECT_DECLARE_SIMPLE_TYPE(RP2040State, RP2040_SOC)
 #define RP2040_I2C1_IRQ         24
 #define RP2040_RTC_IRQ          25
 
-typedef struct RP2040State {
-    SysBusDevice parent_obj;
-
-    ARMv7MState cpu[RP2040_NUM_CORES];
-    
-    MemoryRegion rom;
-    MemoryRegion sram;
-    MemoryRegion xip;
-    MemoryRegion peripherals;
-    
-    /* Core peripherals */
-    RP2040UARTState uart[2];
-    RP2040GPIOState gpio;
-    RP2040TimerState timer;
-    
-    uint32_t num_cpus;
-} RP2040State;
-
 static void rp2040_soc_init(Object *obj)
 {
     RP2040State *s = RP2040_SOC(obj);
@@ -140,14 +107,51 @@ static void rp2040_soc_init(Object *obj)
                           RP2040_ROM_SIZE, &error_fatal);
     memory_region_init_ram(&s->sram, obj, "rp2040.sram", 
                           RP2040_SRAM_SIZE, &error_fatal);
-    memory_region_init_ram(&s->xip, obj, "rp2040.xip", 
-                          RP2040_XIP_SIZE, &error_fatal);
                           
     /* Initialize peripherals */
+    object_initialize_child(obj, "sched", &s->sched, TYPE_RP2040_SCHED);
     object_initialize_child(obj, "uart0", &s->uart[0], TYPE_RP2040_UART);
     object_initialize_child(obj, "uart1", &s->uart[1], TYPE_RP2040_UART);
     object_initialize_child(obj, "gpio", &s->gpio, TYPE_RP2040_GPIO);
+    object_initialize_child(obj, "sio", &s->sio, TYPE_RP2040_SIO);
     object_initialize_child(obj, "timer", &s->timer, TYPE_RP2040_TIMER);
+    object_initialize_child(obj, "xip-ctrl", &s->xip_ctrl, TYPE_RP2040_XIP);
+    object_initialize_child(obj, "testctl", &s->testctl, TYPE_RP2040_TESTCTL);
+}
+
+/*
+ * Back the XIP flash with flash_size bytes.  A flash image file is mapped
+ * privately from a read-only descriptor, so every instance using the same
+ * image shares its page cache pages and only the pages the guest writes
+ * are copied.  Without one the flash is anonymous RAM.
+ */
+static bool rp2040_soc_init_flash(RP2040State *s, Error **errp)
+{
+    if (s->flash_size == 0 || s->flash_size > RP2040_XIP_SIZE ||
+        s->flash_size % RP2040_FLASH_SECTOR_SIZE) {
+        error_setg(errp, "rp2040: flash-size must be a multiple of %d "
+                   "bytes and at most %d bytes",
+                   RP2040_FLASH_SECTOR_SIZE, RP2040_XIP_SIZE);
+        return false;
+    }
+    
+    if (!s->flash_image) {
+        return memory_region_init_ram(&s->xip, OBJECT(s), "rp2040.xip",
+                                      s->flash_size, errp);
+    }
+    
+#ifdef CONFIG_POSIX
+    /*
+     * The mapping cannot extend past the end of the file, so the image
+     * must be a full flash dump; pad a smaller one with truncate -s.
+     */
+    return memory_region_init_ram_from_file(&s->xip, OBJECT(s), "rp2040.xip",
+                                            s->flash_size, 0, RAM_READONLY_FD,
+                                            s->flash_image, 0, errp);
+#else
+    error_setg(errp, "rp2040: flash-image is not supported on this host");
+    return false;
+#endif
 }
 
 static void rp2040_soc_realize(DeviceState *dev_soc, Error **errp)
@@ -177,15 +181,70 @@ static void rp2040_soc_realize(DeviceState *dev_soc, Error **errp)
     }
     
     /* Map memories */
+    if (!rp2040_soc_init_flash(s, errp)) {
+        return;
+    }
     memory_region_add_subregion(get_system_memory(), 
                                RP2040_ROM_BASE, &s->rom);
     memory_region_add_subregion(get_system_memory(), 
                                RP2040_SRAM_BASE, &s->sram);
-    memory_region_add_subregion(get_system_memory(), 
-                               RP2040_XIP_BASE, &s->xip);
+    
+    memory_region_init(&s->loader_root, OBJECT(s), "rp2040.loader",
+                       UINT64_MAX);
+    memory_region_init_alias(&s->loader_sysmem, OBJECT(s),
+                             "rp2040.loader-sysmem", get_system_memory(),
+                             0, UINT64_MAX);
+    memory_region_add_subregion_overlap(&s->loader_root, 0,
+                                        &s->loader_sysmem, 0);
+    memory_region_init_alias(&s->loader_flash, OBJECT(s),
+                             "rp2040.loader-flash", &s->xip,
+                             0, s->flash_size);
+    memory_region_add_subregion_overlap(&s->loader_root, RP2040_XIP_BASE,
+                                        &s->loader_flash, 1);
+    address_space_init(&s->loader_as, &s->loader_root, "rp2040-loader");
     
     /* Realize and connect peripherals */
     
+    /*
+     * One scheduler keeps guest time and the deadlines of all devices.
+     * Guest time runs at time_dilation times host time, and on the host
+     * wall clock with realtime set.  The timer takes its time mode from
+     * the scheduler it is linked to.
+     */
+    qdev_prop_set_uint32(DEVICE(&s->sched), "time-dilation",
+                         s->time_dilation);
+    qdev_prop_set_bit(DEVICE(&s->sched), "realtime", s->realtime);
+    if (!qdev_realize(DEVICE(&s->sched), NULL, errp)) {
+        return;
+    }
+    object_property_set_link(OBJECT(&s->uart[0]), "scheduler",
+                             OBJECT(&s->sched), &error_abort);
+    object_property_set_link(OBJECT(&s->uart[1]), "scheduler",
+                             OBJECT(&s->sched), &error_abort);
+    object_property_set_link(OBJECT(&s->gpio), "scheduler",
+                             OBJECT(&s->sched), &error_abort);
+    object_property_set_link(OBJECT(&s->timer), "scheduler",
+                             OBJECT(&s->sched), &error_abort);
+    object_property_set_link(OBJECT(&s->xip_ctrl), "scheduler",
+                             OBJECT(&s->sched), &error_abort);
+    
+    /*
+     * XIP: the flash is reached at four cache aliases, through the cache
+     * model if enabled, and the cache doubles as SRAM while disabled
+     */
+    object_property_set_link(OBJECT(&s->xip_ctrl), "flash",
+                             OBJECT(&s->xip), &error_abort);
+    if (!sysbus_realize(SYS_BUS_DEVICE(&s->xip_ctrl), errp)) {
+        return;
+    }
+    sysbus_mmio_map(SYS_BUS_DEVICE(&s->xip_ctrl), 0, RP2040_XIP_CTRL_BASE);
+    for (int i = 0; i < RP2040_XIP_NUM_MODES; i++) {
+        sysbus_mmio_map(SYS_BUS_DEVICE(&s->xip_ctrl), 1 + i,
+                        RP2040_XIP_BASE + i * RP2040_XIP_SIZE);
+    }
+    sysbus_mmio_map(SYS_BUS_DEVICE(&s->xip_ctrl), 1 + RP2040_XIP_NUM_MODES,
+                    RP2040_XIP_SRAM_BASE);
+    
     /* UART0 */
     sysbus_realize(SYS_BUS_DEVICE(&s->uart[0]), &err);
     if (err) {
@@ -196,7 +255,13 @@ static void rp2040_soc_realize(DeviceState *dev_soc, Error **errp)
     sysbus_connect_irq(SYS_BUS_DEVICE(&s->uart[0]), 0,
                       qdev_get_gpio_in(DEVICE(&s->cpu[0]), RP2040_UART0_IRQ));
     
-    /* UART1 */
+    /*
+     * UART1.  -global sets expect on both UARTs, and a plain path is
+     * meant for UART0; only a per-UART "%s" template applies here too.
+     */
+    if (s->uart[1].expect_path && !strstr(s->uart[1].expect_path, "%s")) {
+        g_clear_pointer(&s->uart[1].expect_path, g_free);
+    }
     sysbus_realize(SYS_BUS_DEVICE(&s->uart[1]), &err);
     if (err) {
         error_propagate(errp, err);
@@ -206,6 +271,14 @@ static void rp2040_soc_realize(DeviceState *dev_soc, Error **errp)
     sysbus_connect_irq(SYS_BUS_DEVICE(&s->uart[1]), 0,
                       qdev_get_gpio_in(DEVICE(&s->cpu[0]), RP2040_UART1_IRQ));
     
+    /* A per-UART expect template that finds no script is a typo */
+    if (s->uart[0].expect_path && strstr(s->uart[0].expect_path, "%s") &&
+        !s->uart[0].expect && !s->uart[1].expect) {
+        error_setg(errp, "rp2040: no expect script matches '%s' for either "
+                   "UART", s->uart[0].expect_path);
+        return;
+    }
+    
     /* GPIO */
     sysbus_realize(SYS_BUS_DEVICE(&s->gpio), &err);
     if (err) {
@@ -218,6 +291,14 @@ static void rp2040_soc_realize(DeviceState *dev_soc, Error **errp)
     sysbus_connect_irq(SYS_BUS_DEVICE(&s->gpio), 1,
                       qdev_get_gpio_in(DEVICE(&s->cpu[1]), RP2040_IO_IRQ_BANK0));
     
+    /* SIO: drives the GPIO outputs */
+    object_property_set_link(OBJECT(&s->sio), "gpio", OBJECT(&s->gpio),
+                             &error_abort);
+    if (!sysbus_realize(SYS_BUS_DEVICE(&s->sio), errp)) {
+        return;
+    }
+    sysbus_mmio_map(SYS_BUS_DEVICE(&s->sio), 0, RP2040_SIO_BASE);
+    
     /* Timer */
     sysbus_realize(SYS_BUS_DEVICE(&s->timer), &err);
     if (err) {
@@ -230,6 +311,25 @@ static void rp2040_soc_realize(DeviceState *dev_soc, Error **errp)
                           qdev_get_gpio_in(DEVICE(&s->cpu[0]), RP2040_TIMER_IRQ_0 + i));
     }
     
+    /*
+     * Test control: checkpoints SRAM and XIP SRAM, flushes the UARTs and
+     * tells the scheduler's rewind notifiers about every rewind
+     */
+    object_property_set_link(OBJECT(&s->testctl), "sram",
+                             OBJECT(&s->sram), &error_abort);
+    object_property_set_link(OBJECT(&s->testctl), "xip-sram",
+                             OBJECT(&s->xip_ctrl.sram), &error_abort);
+    object_property_set_link(OBJECT(&s->testctl), "uart0",
+                             OBJECT(&s->uart[0]), &error_abort);
+    object_property_set_link(OBJECT(&s->testctl), "uart1",
+                             OBJECT(&s->uart[1]), &error_abort);
+    object_property_set_link(OBJECT(&s->testctl), "scheduler",
+                             OBJECT(&s->sched), &error_abort);
+    if (!sysbus_realize(SYS_BUS_DEVICE(&s->testctl), errp)) {
+        return;
+    }
+    sysbus_mmio_map(SYS_BUS_DEVICE(&s->testctl), 0, RP2040_TESTCTL_BASE);
+    
     /* Create unimplemented device regions for remaining peripherals */
     create_unimplemented_device("rp2040.sysinfo", 
                                RP2040_SYSINFO_BASE, 0x1000);
@@ -245,12 +345,15 @@ static void rp2040_soc_realize(DeviceState *dev_soc, Error **errp)
                                RP2040_PADS_BANK0_BASE, 0x1000);
     create_unimplemented_device("rp2040.watchdog", 
                                RP2040_WATCHDOG_BASE, 0x1000);
-    create_unimplemented_device("rp2040.sio", 
-                               RP2040_SIO_BASE, 0x1000);
 }
 
 static Property rp2040_soc_properties[] = {
     DEFINE_PROP_UINT32("num-cpus", RP2040State, num_cpus, RP2040_NUM_CORES),
+    DEFINE_PROP_UINT32("time-dilation", RP2040State, time_dilation, 1),
+    DEFINE_PROP_BOOL("realtime", RP2040State, realtime, false),
+    DEFINE_PROP_SIZE32("flash-size", RP2040State, flash_size,
+                       RP2040_FLASH_SIZE_DEFAULT),
+    DEFINE_PROP_STRING("flash-image", RP2040State, flash_image),
     DEFINE_PROP_END_OF_LIST(),
 };
 
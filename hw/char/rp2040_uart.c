@@ -7,13 +7,19 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "hw/char/rp2040_uart.h"
+#include "hw/core/cpu.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/qdev-properties-system.h"
 #include "migration/vmstate.h"
+#include "qemu/error-report.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "qemu/bswap.h"
 #include "chardev/char-fe.h"
+#include "sysemu/runstate.h"
 #include "trace.h"
 
 #define UART_DR     0x000  /* Data Register */
@@ -43,6 +49,15 @@
 #define FR_TXFE     (1 << 7)  /* TX FIFO empty */
 #define FR_RI       (1 << 8)
 
+/* Line Control Register bits */
+#define LCR_H_BRK   (1 << 0)  /* Send break */
+#define LCR_H_PEN   (1 << 1)  /* Parity enable */
+#define LCR_H_EPS   (1 << 2)  /* Even parity select */
+#define LCR_H_STP2  (1 << 3)  /* Two stop bits */
+#define LCR_H_FEN   (1 << 4)  /* FIFO enable */
+#define LCR_H_WLEN_SHIFT 5
+#define LCR_H_WLEN_MASK  (3 << LCR_H_WLEN_SHIFT)  /* Word length - 5 */
+
 /* Control Register bits */
 #define CR_UARTEN   (1 << 0)  /* UART enable */
 #define CR_SIREN    (1 << 1)  /* SIR enable */
@@ -69,9 +84,58 @@
 #define INT_PE      (1 << 8)
 #define INT_BE      (1 << 9)
 #define INT_OE      (1 << 10)
+#define INT_ERRORS  (INT_FE | INT_PE | INT_BE | INT_OE)
+
+/* DMA Control Register bits */
+#define DMACR_RXDMAE    (1 << 0)  /* RX DMA enable */
+#define DMACR_TXDMAE    (1 << 1)  /* TX DMA enable */
+#define DMACR_DMAONERR  (1 << 2)  /* Gate RX DMA on error interrupt */
 
 #define FIFO_SIZE   32
 
+/*
+ * Virtual time a partially filled TX FIFO may sit before it is drained to
+ * the backend.  Bytes are otherwise only pushed out once the FIFO fills up
+ * or the guest waits on UART_FR for it to empty, so a printf costs one
+ * chardev write per line rather than one per character.
+ */
+#define TX_DRAIN_DELAY_NS   (100 * SCALE_US)
+
+/*
+ * Capture file layout: an 8-byte magic followed by 9-byte records, each a
+ * little-endian 64-bit virtual-clock timestamp in ns with bit 63 set for
+ * received bytes and bit 62 set in every record, then the data byte.  The
+ * file is written through a shared mapping that is extended one chunk at
+ * a time, so a file left behind by a killed QEMU ends in zeroes; the first
+ * record without bit 62 marks the end of the data.
+ */
+#define CAPTURE_MAGIC       "RP2UCAP2"
+#define CAPTURE_RX          (1ULL << 63)
+#define CAPTURE_VALID       (1ULL << 62)
+#define CAPTURE_CHUNK_SIZE  (1024 * 1024)
+
+/* Interrupt FIFO Level Select fields */
+#define IFLS_TXIFLSEL(v)    ((v) & 0x7)
+#define IFLS_RXIFLSEL(v)    (((v) >> 3) & 0x7)
+
+/* Receive timeout used before a baud rate divisor has been programmed */
+#define RX_TIMEOUT_DEFAULT_NS (32 * NANOSECONDS_PER_SECOND / 115200)
+
+/* FR reads with no change in between before a poll loop is assumed */
+#define POLL_THRESHOLD 16
+
+/* FIFO levels selected by IFLS: 1/8, 1/4, 1/2, 3/4 and 7/8 full */
+static uint32_t rp2040_uart_fifo_trigger(uint32_t sel)
+{
+    static const uint32_t levels[] = {
+        FIFO_SIZE / 8, FIFO_SIZE / 4, FIFO_SIZE / 2,
+        FIFO_SIZE * 3 / 4, FIFO_SIZE * 7 / 8,
+    };
+    
+    /* Reserved encodings behave like the 1/2 reset value */
+    return sel < ARRAY_SIZE(levels) ? levels[sel] : FIFO_SIZE / 2;
+}
+
 static void rp2040_uart_update(RP2040UARTState *s)
 {
     uint32_t flags = 0;
@@ -89,12 +153,536 @@ static void rp2040_uart_update(RP2040UARTState *s)
     if (s->tx_fifo_len == FIFO_SIZE) {
         flags |= FR_TXFF;
     }
+    if (s->tx_fifo_len > 0) {
+        flags |= FR_BUSY;
+    }
     
     s->fr = flags;
     
     /* Update interrupts */
     s->mis = s->ris & s->imsc;
     qemu_set_irq(s->irq, s->mis != 0);
+    
+    /*
+     * DMA requests: TX while there is room in the TX FIFO, RX while the RX
+     * FIFO holds data, unless DMAONERR holds RX off on a pending error.
+     */
+    qemu_set_irq(s->tx_dreq, (s->dmacr & DMACR_TXDMAE) &&
+                 s->tx_fifo_len < FIFO_SIZE);
+    qemu_set_irq(s->rx_dreq, (s->dmacr & DMACR_RXDMAE) &&
+                 s->rx_fifo_len > 0 &&
+                 !((s->dmacr & DMACR_DMAONERR) && (s->ris & INT_ERRORS)));
+}
+
+/*
+ * INT_TX is asserted when the TX FIFO level drops to the trigger level and
+ * deasserted once writes take it back above, as on the PL011.
+ */
+static void rp2040_uart_tx_update_int(RP2040UARTState *s, uint32_t old_len)
+{
+    uint32_t trigger = rp2040_uart_fifo_trigger(IFLS_TXIFLSEL(s->ifls));
+    
+    if (s->tx_fifo_len > trigger) {
+        s->ris &= ~INT_TX;
+    } else if (old_len > trigger) {
+        s->ris |= INT_TX;
+    }
+}
+
+/* INT_RX is asserted while the RX FIFO is at or above the trigger level */
+static void rp2040_uart_rx_update_int(RP2040UARTState *s)
+{
+    uint32_t trigger = rp2040_uart_fifo_trigger(IFLS_RXIFLSEL(s->ifls));
+    
+    if (s->rx_fifo_len >= trigger) {
+        s->ris |= INT_RX;
+    } else {
+        s->ris &= ~INT_RX;
+    }
+    if (s->rx_fifo_len == 0) {
+        s->ris &= ~INT_RT;
+        rp2040_event_del(&s->rt_timer);
+    }
+}
+
+/*
+ * Duration of the given number of bit periods in ns at the programmed baud
+ * rate, or 0 while the divisor has not been programmed.
+ */
+static int64_t rp2040_uart_bits_to_ns(RP2040UARTState *s, uint32_t bits)
+{
+    uint64_t divisor = ((s->ibrd & 0xFFFF) << 6) | (s->fbrd & 0x3F);
+    
+    if (divisor == 0 || s->clk_freq == 0) {
+        return 0;
+    }
+    
+    /*
+     * Baud rate = UARTCLK / (16 * (IBRD + FBRD / 64)), so one bit lasts
+     * 16 * divisor / (64 * UARTCLK) = divisor / (4 * UARTCLK) seconds.
+     */
+    return muldiv64(divisor * bits, NANOSECONDS_PER_SECOND, 4 * s->clk_freq);
+}
+
+/*
+ * Duration of one character frame in ns, derived from the programmed baud
+ * rate divisor and LCR_H frame format.  Returns 0 when no pacing applies,
+ * either because turbo mode is selected or because the divisor has not
+ * been programmed yet.
+ */
+static int64_t rp2040_uart_char_time_ns(RP2040UARTState *s)
+{
+    uint32_t bits;
+    
+    if (s->pacing != RP2040_UART_PACING_ACCURATE) {
+        return 0;
+    }
+    
+    /* Start bit, data bits, optional parity and one or two stop bits */
+    bits = 1 + 5 + ((s->lcr_h & LCR_H_WLEN_MASK) >> LCR_H_WLEN_SHIFT);
+    bits += (s->lcr_h & LCR_H_PEN) ? 1 : 0;
+    bits += (s->lcr_h & LCR_H_STP2) ? 2 : 1;
+    
+    return rp2040_uart_bits_to_ns(s, bits);
+}
+
+/* Receive timeout: the line has been idle for 32 bit periods */
+static void rp2040_uart_rt_timer_cb(void *opaque)
+{
+    RP2040UARTState *s = opaque;
+    
+    if (s->rx_fifo_len > 0) {
+        s->ris |= INT_RT;
+        rp2040_uart_update(s);
+    }
+}
+
+static void rp2040_uart_rt_restart(RP2040UARTState *s)
+{
+    int64_t timeout = rp2040_uart_bits_to_ns(s, 32);
+    
+    if (!timeout) {
+        timeout = RX_TIMEOUT_DEFAULT_NS;
+    }
+    rp2040_event_mod(&s->rt_timer, rp2040_sched_now_ns(s->sched) + timeout);
+}
+
+static void rp2040_uart_capture_close(RP2040UARTState *s)
+{
+    if (s->capture_fd < 0) {
+        return;
+    }
+    if (s->capture_map) {
+        munmap(s->capture_map, CAPTURE_CHUNK_SIZE);
+        s->capture_map = NULL;
+    }
+    /* Trim the unused tail of the last chunk */
+    if (ftruncate(s->capture_fd, s->capture_base + s->capture_pos) < 0) {
+        warn_report("rp2040-uart: failed to truncate capture file: %s",
+                    strerror(errno));
+    }
+    close(s->capture_fd);
+    s->capture_fd = -1;
+}
+
+/* Grow the file by one chunk and map it in place of the current one */
+static bool rp2040_uart_capture_next_chunk(RP2040UARTState *s)
+{
+    void *map;
+    
+    if (s->capture_map) {
+        munmap(s->capture_map, CAPTURE_CHUNK_SIZE);
+        s->capture_map = NULL;
+        s->capture_base += CAPTURE_CHUNK_SIZE;
+    }
+    s->capture_pos = 0;
+    
+    if (ftruncate(s->capture_fd, s->capture_base + CAPTURE_CHUNK_SIZE) < 0) {
+        goto fail;
+    }
+    map = mmap(NULL, CAPTURE_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+               s->capture_fd, s->capture_base);
+    if (map == MAP_FAILED) {
+        goto fail;
+    }
+    s->capture_map = map;
+    return true;
+    
+fail:
+    warn_report("rp2040-uart: capture stopped: %s", strerror(errno));
+    rp2040_uart_capture_close(s);
+    return false;
+}
+
+static void rp2040_uart_capture_write(RP2040UARTState *s,
+                                      const uint8_t *buf, uint32_t len)
+{
+    while (len > 0) {
+        uint32_t n;
+        
+        if (s->capture_pos == CAPTURE_CHUNK_SIZE &&
+            !rp2040_uart_capture_next_chunk(s)) {
+            return;
+        }
+        n = MIN(len, CAPTURE_CHUNK_SIZE - s->capture_pos);
+        memcpy(s->capture_map + s->capture_pos, buf, n);
+        s->capture_pos += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Record one byte crossing the UART in either direction */
+static void rp2040_uart_capture(RP2040UARTState *s, bool rx, uint8_t ch)
+{
+    uint8_t rec[9];
+    
+    if (likely(s->capture_fd < 0)) {
+        return;
+    }
+    stq_le_p(rec, rp2040_sched_now_ns(s->sched) | CAPTURE_VALID |
+             (rx ? CAPTURE_RX : 0));
+    rec[8] = ch;
+    rp2040_uart_capture_write(s, rec, sizeof(rec));
+}
+
+/* "%s" expands to the device name so one -global covers both UARTs */
+static char *rp2040_uart_expand_path(RP2040UARTState *s, const char *tmpl)
+{
+    g_autofree char *name = object_get_canonical_path_component(OBJECT(s));
+    const char *subst = strstr(tmpl, "%s");
+    
+    if (!subst) {
+        return g_strdup(tmpl);
+    }
+    return g_strdup_printf("%.*s%s%s", (int)(subst - tmpl), tmpl,
+                           name ? name : "uart", subst + 2);
+}
+
+static bool rp2040_uart_capture_open(RP2040UARTState *s, Error **errp)
+{
+    g_autofree char *path = rp2040_uart_expand_path(s, s->capture_path);
+    
+    s->capture_fd = qemu_create(path, O_RDWR | O_TRUNC, 0644, errp);
+    if (s->capture_fd < 0) {
+        return false;
+    }
+    s->capture_base = 0;
+    s->capture_pos = CAPTURE_CHUNK_SIZE;
+    if (!rp2040_uart_capture_next_chunk(s)) {
+        error_setg(errp, "rp2040-uart: cannot map capture file '%s'", path);
+        return false;
+    }
+    rp2040_uart_capture_write(s, (const uint8_t *)CAPTURE_MAGIC,
+                              strlen(CAPTURE_MAGIC));
+    return true;
+}
+
+/*
+ * Asynchronous output: the vCPU copies TX data into a ring and a bottom
+ * half hands it to the chardev from the main loop without blocking.  When
+ * the backend cannot take everything at once, a watch on the chardev
+ * resumes the writes as soon as it can, so a slow backend only stalls the
+ * guest once the ring fills.  head and tail run freely and are masked
+ * with the power-of-two ring size.
+ */
+
+/* Write out everything in the ring, waiting for the backend if need be */
+static void rp2040_uart_tx_ring_flush(RP2040UARTState *s)
+{
+    uint32_t mask = s->tx_ring_size - 1;
+    
+    if (!s->tx_async) {
+        return;
+    }
+    
+    qemu_bh_cancel(s->tx_bh);
+    if (s->tx_watch) {
+        g_source_remove(s->tx_watch);
+        s->tx_watch = 0;
+    }
+    while (s->tx_ring_head != s->tx_ring_tail) {
+        uint32_t tail = s->tx_ring_tail;
+        uint32_t n = MIN(s->tx_ring_head - tail,
+                         s->tx_ring_size - (tail & mask));
+        
+        qemu_chr_fe_write_all(&s->chr, s->tx_ring + (tail & mask), n);
+        s->tx_ring_tail = tail + n;
+    }
+}
+
+static gboolean rp2040_uart_tx_ring_write(void *do_not_use, GIOCondition cond,
+                                          void *opaque)
+{
+    RP2040UARTState *s = opaque;
+    uint32_t mask = s->tx_ring_size - 1;
+    
+    s->tx_watch = 0;
+    while (s->tx_ring_head != s->tx_ring_tail) {
+        uint32_t tail = s->tx_ring_tail;
+        /* Write up to the end of the ring in one go */
+        uint32_t n = MIN(s->tx_ring_head - tail,
+                         s->tx_ring_size - (tail & mask));
+        int ret = qemu_chr_fe_write(&s->chr, s->tx_ring + (tail & mask), n);
+        
+        if (ret > 0) {
+            s->tx_ring_tail += ret;
+        }
+        if (ret < (int)n) {
+            s->tx_watch = qemu_chr_fe_add_watch(&s->chr, G_IO_OUT | G_IO_HUP,
+                                                rp2040_uart_tx_ring_write, s);
+            if (!s->tx_watch) {
+                /*
+                 * No way to learn when the backend is writable again, so
+                 * wait for it rather than drop the output
+                 */
+                rp2040_uart_tx_ring_flush(s);
+            }
+            break;
+        }
+    }
+    
+    return G_SOURCE_REMOVE;
+}
+
+static void rp2040_uart_tx_bh(void *opaque)
+{
+    RP2040UARTState *s = opaque;
+    
+    if (!s->tx_watch) {
+        rp2040_uart_tx_ring_write(NULL, 0, s);
+    }
+}
+
+static uint32_t rp2040_uart_tx_ring_push(RP2040UARTState *s,
+                                         const uint8_t *buf, uint32_t len)
+{
+    uint32_t mask = s->tx_ring_size - 1;
+    uint32_t head = s->tx_ring_head;
+    uint32_t n = MIN(len, s->tx_ring_size - (head - s->tx_ring_tail));
+    uint32_t first = MIN(n, s->tx_ring_size - (head & mask));
+    
+    memcpy(s->tx_ring + (head & mask), buf, first);
+    memcpy(s->tx_ring, buf + first, n - first);
+    s->tx_ring_head = head + n;
+    if (n && !s->tx_watch) {
+        qemu_bh_schedule(s->tx_bh);
+    }
+    
+    return n;
+}
+
+/*
+ * Hand up to max bytes from the head of the TX FIFO to the backend.  In
+ * async mode only as many bytes as fit in the ring leave the FIFO.
+ */
+static void rp2040_uart_tx_drain(RP2040UARTState *s, uint32_t max)
+{
+    uint8_t buf[FIFO_SIZE];
+    uint32_t old_len = s->tx_fifo_len;
+    uint32_t rd = s->tx_fifo_rd;
+    uint32_t n = 0;
+    
+    while (n < s->tx_fifo_len && n < max) {
+        buf[n++] = s->tx_fifo[rd];
+        rd = (rd + 1) % FIFO_SIZE;
+    }
+    if (n == 0) {
+        return;
+    }
+    
+    if (s->tx_async) {
+        n = rp2040_uart_tx_ring_push(s, buf, n);
+    } else {
+        /*
+         * A backend that is not ready blocks the vCPU here, which is the
+         * intended back-pressure: no output is lost and guest time does
+         * not run ahead of a slow consumer.  tx-async avoids the stall.
+         */
+        qemu_chr_fe_write_all(&s->chr, buf, n);
+    }
+    
+    s->tx_fifo_rd = (s->tx_fifo_rd + n) % FIFO_SIZE;
+    s->tx_fifo_len -= n;
+    
+    rp2040_uart_tx_update_int(s, old_len);
+    rp2040_uart_update(s);
+}
+
+/* Hand everything queued in the TX FIFO to the backend in one write */
+static void rp2040_uart_tx_flush(RP2040UARTState *s)
+{
+    rp2040_event_del(&s->tx_timer);
+    rp2040_uart_tx_drain(s, FIFO_SIZE);
+    
+    if (s->tx_fifo_len > 0) {
+        /* The async ring is full; retry once the backend has caught up */
+        rp2040_event_mod(&s->tx_timer,
+                         rp2040_sched_now_ns(s->sched) + TX_DRAIN_DELAY_NS);
+    }
+}
+
+static void rp2040_uart_tx_push(RP2040UARTState *s, uint8_t ch)
+{
+    uint32_t old_len = s->tx_fifo_len;
+    int64_t char_ns = rp2040_uart_char_time_ns(s);
+    
+    if (s->tx_fifo_len == FIFO_SIZE) {
+        /* Data written to a full FIFO is lost */
+        return;
+    }
+    
+    s->tx_fifo[s->tx_fifo_wr] = ch;
+    s->tx_fifo_wr = (s->tx_fifo_wr + 1) % FIFO_SIZE;
+    s->tx_fifo_len++;
+    rp2040_uart_tx_update_int(s, old_len);
+    rp2040_uart_capture(s, false, ch);
+    if (unlikely(s->expect)) {
+        rp2040_uart_expect_feed(s->expect, ch);
+    }
+    
+    if (char_ns) {
+        /* Start shifting out if the transmitter was idle */
+        if (!rp2040_event_pending(&s->tx_timer)) {
+            rp2040_event_mod(&s->tx_timer,
+                             rp2040_sched_now_ns(s->sched) + char_ns);
+        }
+        rp2040_uart_update(s);
+        return;
+    }
+    
+    if (s->tx_fifo_len == FIFO_SIZE) {
+        rp2040_uart_tx_flush(s);
+        return;
+    }
+    
+    if (!rp2040_event_pending(&s->tx_timer)) {
+        rp2040_event_mod(&s->tx_timer,
+                         rp2040_sched_now_ns(s->sched) + TX_DRAIN_DELAY_NS);
+    }
+    rp2040_uart_update(s);
+}
+
+static void rp2040_uart_tx_timer_cb(void *opaque)
+{
+    RP2040UARTState *s = opaque;
+    int64_t char_ns = rp2040_uart_char_time_ns(s);
+    
+    if (!char_ns) {
+        rp2040_uart_tx_flush(s);
+        return;
+    }
+    
+    /* The character at the head of the FIFO has finished shifting out */
+    rp2040_uart_tx_drain(s, 1);
+    if (s->tx_fifo_len > 0) {
+        rp2040_event_mod(&s->tx_timer,
+                         rp2040_sched_now_ns(s->sched) + char_ns);
+    }
+}
+
+/* Whether the RX FIFO can take another character right now */
+static bool rp2040_uart_rx_ready(RP2040UARTState *s)
+{
+    if (s->rx_fifo_len == FIFO_SIZE) {
+        return false;
+    }
+    return !rp2040_uart_char_time_ns(s) ||
+           !rp2040_event_pending(&s->rx_timer);
+}
+
+static void rp2040_uart_rx_push(RP2040UARTState *s, uint8_t ch)
+{
+    rp2040_uart_capture(s, true, ch);
+    s->rx_fifo[s->rx_fifo_wr] = ch;
+    s->rx_fifo_wr = (s->rx_fifo_wr + 1) % FIFO_SIZE;
+    s->rx_fifo_len++;
+    s->rx_delivered++;
+}
+
+/* Update pacing, timeout and interrupt state after characters arrived */
+static void rp2040_uart_rx_received(RP2040UARTState *s)
+{
+    int64_t char_ns = rp2040_uart_char_time_ns(s);
+    
+    if (char_ns) {
+        /* Hold off the next character for one frame time */
+        rp2040_event_mod(&s->rx_timer,
+                         rp2040_sched_now_ns(s->sched) + char_ns);
+    }
+    rp2040_uart_rx_update_int(s);
+    rp2040_uart_rt_restart(s);
+    rp2040_uart_update(s);
+}
+
+/* Move staged characters into the RX FIFO as space and pacing allow */
+static void rp2040_uart_rx_refill(RP2040UARTState *s)
+{
+    bool paced = rp2040_uart_char_time_ns(s) != 0;
+    uint32_t n = 0;
+    
+    while (s->rx_stage_len > 0 && rp2040_uart_rx_ready(s)) {
+        rp2040_uart_rx_push(s, s->rx_stage[s->rx_stage_rd]);
+        s->rx_stage_rd = (s->rx_stage_rd + 1) % s->rx_stage_size;
+        s->rx_stage_len--;
+        n++;
+        if (paced) {
+            break;
+        }
+    }
+    
+    if (n) {
+        rp2040_uart_rx_received(s);
+    }
+}
+
+static void rp2040_uart_rx_timer_cb(void *opaque)
+{
+    RP2040UARTState *s = opaque;
+    
+    /* The receiver is ready for the next character */
+    rp2040_uart_rx_refill(s);
+    qemu_chr_fe_accept_input(&s->chr);
+}
+
+/*
+ * The guest is spinning on FR in accurate mode, waiting for the line to
+ * move a character.  Advance guest time to the end of the pending TX or
+ * RX character time rather than burning host time until it expires.  As
+ * with the timer's poll fast-forward, time moves for the whole SoC, so
+ * this is only done while every other core sleeps.
+ */
+static void rp2040_uart_poll(RP2040UARTState *s)
+{
+    int64_t deadline = INT64_MAX;
+    CPUState *cpu;
+    
+    if (s->fr != s->poll_fr) {
+        s->poll_fr = s->fr;
+        s->poll_count = 0;
+        return;
+    }
+    if (++s->poll_count < POLL_THRESHOLD) {
+        return;
+    }
+    
+    s->poll_count = 0;
+    CPU_FOREACH(cpu) {
+        if (cpu != current_cpu && !cpu->halted) {
+            return;
+        }
+    }
+    
+    if (rp2040_event_pending(&s->tx_timer)) {
+        deadline = s->tx_timer.deadline;
+    }
+    if (rp2040_event_pending(&s->rx_timer)) {
+        deadline = MIN(deadline, s->rx_timer.deadline);
+    }
+    if (deadline != INT64_MAX) {
+        rp2040_sched_advance(s->sched,
+                             deadline - rp2040_sched_now_ns(s->sched));
+    }
 }
 
 static uint64_t rp2040_uart_read(void *opaque, hwaddr offset, unsigned size)
@@ -104,14 +692,15 @@ static uint64_t rp2040_uart_read(void *opaque, hwaddr offset, unsigned size)
     
     switch (offset) {
     case UART_DR:
+        s->poll_count = 0;
         if (s->rx_fifo_len > 0) {
             val = s->rx_fifo[s->rx_fifo_rd];
             s->rx_fifo_rd = (s->rx_fifo_rd + 1) % FIFO_SIZE;
             s->rx_fifo_len--;
-            if (s->rx_fifo_len == 0) {
-                s->ris &= ~INT_RX;
-            }
+            rp2040_uart_rx_update_int(s);
+            rp2040_uart_rx_refill(s);
             rp2040_uart_update(s);
+            qemu_chr_fe_accept_input(&s->chr);
         }
         break;
         
@@ -120,6 +709,19 @@ static uint64_t rp2040_uart_read(void *opaque, hwaddr offset, unsigned size)
         break;
         
     case UART_FR:
+        /*
+         * uart_putc() reads FR once before each DR write, which leaves the
+         * output queued.  A second read with no DR write in between means
+         * the guest is waiting for TXFE or !BUSY, so drain the FIFO then.
+         * In accurate mode the output drains at the line rate instead.
+         */
+        if (!rp2040_uart_char_time_ns(s)) {
+            if (++s->tx_fr_reads > 1 && s->tx_fifo_len) {
+                rp2040_uart_tx_flush(s);
+            }
+        } else if (s->poll_ff) {
+            rp2040_uart_poll(s);
+        }
         val = s->fr;
         break;
         
@@ -178,14 +780,16 @@ static void rp2040_uart_write(void *opaque, hwaddr offset,
     RP2040UARTState *s = opaque;
     unsigned char ch;
     
+    s->poll_count = 0;
+    rp2040_sched_note_write(s->sched, OBJECT(s), offset, value);
+    
     switch (offset) {
     case UART_DR:
         ch = value;
+        s->tx_fr_reads = 0;
         if (s->cr & CR_UARTEN) {
             if (s->cr & CR_TXE) {
-                qemu_chr_fe_write(&s->chr, &ch, 1);
-                s->ris |= INT_TX;
-                rp2040_uart_update(s);
+                rp2040_uart_tx_push(s, ch);
             }
         }
         break;
@@ -220,6 +824,8 @@ static void rp2040_uart_write(void *opaque, hwaddr offset,
         
     case UART_IFLS:
         s->ifls = value;
+        rp2040_uart_rx_update_int(s);
+        rp2040_uart_update(s);
         break;
         
     case UART_IMSC:
@@ -233,7 +839,8 @@ static void rp2040_uart_write(void *opaque, hwaddr offset,
         break;
         
     case UART_DMACR:
-        s->dmacr = value;
+        s->dmacr = value & (DMACR_RXDMAE | DMACR_TXDMAE | DMACR_DMAONERR);
+        rp2040_uart_update(s);
         break;
         
     default:
@@ -252,35 +859,54 @@ static const MemoryRegionOps rp2040_uart_ops = {
 static void rp2040_uart_rx(void *opaque, const uint8_t *buf, int size)
 {
     RP2040UARTState *s = opaque;
+    bool paced = rp2040_uart_char_time_ns(s) != 0;
+    uint32_t n = 0;
     
     if (!(s->cr & CR_UARTEN) || !(s->cr & CR_RXE)) {
         return;
     }
     
     for (int i = 0; i < size; i++) {
-        if (s->rx_fifo_len < FIFO_SIZE) {
-            s->rx_fifo[s->rx_fifo_wr] = buf[i];
-            s->rx_fifo_wr = (s->rx_fifo_wr + 1) % FIFO_SIZE;
-            s->rx_fifo_len++;
-            s->ris |= INT_RX;
+        if (s->rx_stage_len == 0 && rp2040_uart_rx_ready(s) &&
+            !(paced && n > 0)) {
+            rp2040_uart_rx_push(s, buf[i]);
+            n++;
+        } else if (s->rx_stage_len < s->rx_stage_size) {
+            /* FIFO full or paced: park the character in the staging ring */
+            s->rx_stage[s->rx_stage_wr] = buf[i];
+            s->rx_stage_wr = (s->rx_stage_wr + 1) % s->rx_stage_size;
+            s->rx_stage_len++;
+            s->rx_stage_peak = MAX(s->rx_stage_peak, s->rx_stage_len);
         } else {
             s->ris |= INT_OE;
+            s->rx_dropped += size - i;
             break;
         }
     }
     
-    rp2040_uart_update(s);
+    if (n) {
+        rp2040_uart_rx_received(s);
+    } else {
+        rp2040_uart_update(s);
+    }
 }
 
 static int rp2040_uart_can_rx(void *opaque)
 {
     RP2040UARTState *s = opaque;
+    int room;
     
     if (!(s->cr & CR_UARTEN) || !(s->cr & CR_RXE)) {
         return 0;
     }
     
-    return FIFO_SIZE - s->rx_fifo_len;
+    room = s->rx_stage_size - s->rx_stage_len;
+    if (s->rx_stage_len == 0 && rp2040_uart_rx_ready(s)) {
+        /* Accept one character per frame time when paced */
+        room += rp2040_uart_char_time_ns(s) ? 1 : FIFO_SIZE - s->rx_fifo_len;
+    }
+    
+    return room;
 }
 
 static void rp2040_uart_event(void *opaque, QEMUChrEvent event)
@@ -288,6 +914,41 @@ static void rp2040_uart_event(void *opaque, QEMUChrEvent event)
     /* Handle character device events if needed */
 }
 
+/*
+ * Write out everything the guest has sent so far, the TX FIFO included,
+ * without waiting for character times
+ */
+void rp2040_uart_flush(RP2040UARTState *s)
+{
+    /* The ring may not take the whole FIFO while it is still full */
+    do {
+        rp2040_uart_tx_flush(s);
+        rp2040_uart_tx_ring_flush(s);
+    } while (s->tx_fifo_len > 0);
+}
+
+/*
+ * Attach the UART to another chardev, e.g. a fresh log per test run, or
+ * to none with chr NULL.  Output already sent by the guest goes to the
+ * old one.
+ */
+bool rp2040_uart_set_chardev(RP2040UARTState *s, Chardev *chr, Error **errp)
+{
+    rp2040_uart_flush(s);
+    
+    qemu_chr_fe_deinit(&s->chr, false);
+    if (!chr) {
+        return true;
+    }
+    if (!qemu_chr_fe_init(&s->chr, chr, errp)) {
+        return false;
+    }
+    qemu_chr_fe_set_handlers(&s->chr, rp2040_uart_can_rx,
+                             rp2040_uart_rx, rp2040_uart_event,
+                             NULL, s, NULL, true);
+    return true;
+}
+
 static void rp2040_uart_reset(DeviceState *dev)
 {
     RP2040UARTState *s = RP2040_UART(dev);
@@ -309,7 +970,23 @@ static void rp2040_uart_reset(DeviceState *dev)
     s->rx_fifo_len = 0;
     s->rx_fifo_rd = 0;
     s->rx_fifo_wr = 0;
+    s->rx_stage_len = 0;
+    s->rx_stage_rd = 0;
+    s->rx_stage_wr = 0;
+    s->rx_delivered = 0;
+    s->rx_dropped = 0;
+    s->rx_stage_peak = 0;
     s->tx_fifo_len = 0;
+    s->tx_fifo_rd = 0;
+    s->tx_fifo_wr = 0;
+    s->tx_fr_reads = 0;
+    rp2040_event_del(&s->tx_timer);
+    rp2040_event_del(&s->rx_timer);
+    rp2040_event_del(&s->rt_timer);
+    
+    if (s->expect) {
+        rp2040_uart_expect_reset(s->expect);
+    }
     
     rp2040_uart_update(s);
 }
@@ -323,21 +1000,146 @@ static void rp2040_uart_init(Object *obj)
                          TYPE_RP2040_UART, 0x1000);
     sysbus_init_mmio(sbd, &s->mmio);
     sysbus_init_irq(sbd, &s->irq);
+    s->capture_fd = -1;
+    qdev_init_gpio_out_named(DEVICE(obj), &s->tx_dreq, "tx-dreq", 1);
+    qdev_init_gpio_out_named(DEVICE(obj), &s->rx_dreq, "rx-dreq", 1);
+    
+    object_property_add_uint64_ptr(obj, "rx-delivered", &s->rx_delivered,
+                                   OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "rx-dropped", &s->rx_dropped,
+                                   OBJ_PROP_FLAG_READ);
+    object_property_add_uint32_ptr(obj, "rx-staging-peak", &s->rx_stage_peak,
+                                   OBJ_PROP_FLAG_READ);
+}
+
+static void rp2040_uart_shutdown_notify(Notifier *notifier, void *data)
+{
+    RP2040UARTState *s = container_of(notifier, RP2040UARTState,
+                                      shutdown_notifier);
+    
+    /* Make sure queued output reaches the backend before QEMU exits */
+    rp2040_uart_flush(s);
+    rp2040_uart_capture_close(s);
 }
 
 static void rp2040_uart_realize(DeviceState *dev, Error **errp)
 {
     RP2040UARTState *s = RP2040_UART(dev);
     
+    if (!s->pacing_str || !strcmp(s->pacing_str, "turbo")) {
+        s->pacing = RP2040_UART_PACING_TURBO;
+    } else if (!strcmp(s->pacing_str, "accurate")) {
+        s->pacing = RP2040_UART_PACING_ACCURATE;
+    } else {
+        error_setg(errp, "rp2040-uart: invalid pacing '%s' "
+                   "(expected 'turbo' or 'accurate')", s->pacing_str);
+        return;
+    }
+    
+    if (s->tx_async &&
+        (s->tx_ring_size < FIFO_SIZE || !is_power_of_2(s->tx_ring_size))) {
+        error_setg(errp, "rp2040-uart: tx-async-size must be a power of "
+                   "two of at least %d bytes", FIFO_SIZE);
+        return;
+    }
+    
+    if (!s->sched) {
+        s->sched = rp2040_sched_create(OBJECT(dev), false, errp);
+        if (!s->sched) {
+            return;
+        }
+    }
+    
+    if (s->capture_path && !rp2040_uart_capture_open(s, errp)) {
+        return;
+    }
+    
+    /*
+     * With "%s" in the path each UART has its own script, and a UART
+     * without one is left alone (the SoC checks that one has a script).
+     */
+    if (s->expect_path) {
+        g_autofree char *name = object_get_canonical_path_component(OBJECT(s));
+        g_autofree char *path = rp2040_uart_expand_path(s, s->expect_path);
+        
+        if (!strstr(s->expect_path, "%s") || access(path, F_OK) == 0) {
+            s->expect = rp2040_uart_expect_new(name ? name : "rp2040-uart",
+                                               path, s->sched, errp);
+            if (!s->expect) {
+                rp2040_uart_capture_close(s);
+                return;
+            }
+        }
+    }
+    
+    /* Nothing can fail from here on */
+    if (s->rx_stage_size) {
+        s->rx_stage = g_malloc(s->rx_stage_size);
+    }
+    
+    if (s->tx_async) {
+        s->tx_ring = g_malloc(s->tx_ring_size);
+        s->tx_bh = qemu_bh_new(rp2040_uart_tx_bh, s);
+    }
+    
+    /*
+     * Only async output and a capture file have anything left to finish
+     * when QEMU exits; a plain UART does not need to hear about it.
+     */
+    if (s->tx_async || s->capture_path) {
+        s->shutdown_notifier.notify = rp2040_uart_shutdown_notify;
+        qemu_register_shutdown_notifier(&s->shutdown_notifier);
+    }
+    
+    rp2040_event_init(&s->tx_timer, s->sched, rp2040_uart_tx_timer_cb, s);
+    rp2040_event_init(&s->rx_timer, s->sched, rp2040_uart_rx_timer_cb, s);
+    rp2040_event_init(&s->rt_timer, s->sched, rp2040_uart_rt_timer_cb, s);
+    
     qemu_chr_fe_set_handlers(&s->chr, rp2040_uart_can_rx,
                             rp2040_uart_rx, rp2040_uart_event,
                             NULL, s, NULL, true);
 }
 
-static const VMStateDescription vmstate_rp2040_uart = {
-    .name = TYPE_RP2040_UART,
+static void rp2040_uart_unrealize(DeviceState *dev)
+{
+    RP2040UARTState *s = RP2040_UART(dev);
+    
+    rp2040_uart_tx_ring_flush(s);
+    if (s->tx_bh) {
+        qemu_bh_delete(s->tx_bh);
+        s->tx_bh = NULL;
+    }
+    rp2040_uart_capture_close(s);
+    rp2040_uart_expect_free(s->expect);
+    s->expect = NULL;
+    if (s->shutdown_notifier.notify) {
+        notifier_remove(&s->shutdown_notifier);
+    }
+}
+
+static bool rp2040_uart_expect_needed(void *opaque)
+{
+    RP2040UARTState *s = opaque;
+    
+    return s->expect != NULL;
+}
+
+static const VMStateDescription vmstate_rp2040_uart_expect_state = {
+    .name = TYPE_RP2040_UART "/expect",
     .version_id = 1,
     .minimum_version_id = 1,
+    .needed = rp2040_uart_expect_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_POINTER(expect, RP2040UARTState,
+                               vmstate_rp2040_uart_expect, RP2040UARTExpect),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_rp2040_uart = {
+    .name = TYPE_RP2040_UART,
+    .version_id = 6,
+    .minimum_version_id = 6,
     .fields = (VMStateField[]) {
         VMSTATE_UINT32(dr, RP2040UARTState),
         VMSTATE_UINT32(rsr, RP2040UARTState),
@@ -356,13 +1158,40 @@ static const VMStateDescription vmstate_rp2040_uart = {
         VMSTATE_UINT32(rx_fifo_len, RP2040UARTState),
         VMSTATE_UINT32(rx_fifo_rd, RP2040UARTState),
         VMSTATE_UINT32(rx_fifo_wr, RP2040UARTState),
+        VMSTATE_VBUFFER_UINT32(rx_stage, RP2040UARTState, 0, NULL,
+                               rx_stage_size),
+        VMSTATE_UINT32(rx_stage_len, RP2040UARTState),
+        VMSTATE_UINT32(rx_stage_rd, RP2040UARTState),
+        VMSTATE_UINT32(rx_stage_wr, RP2040UARTState),
+        VMSTATE_BUFFER(tx_fifo, RP2040UARTState),
         VMSTATE_UINT32(tx_fifo_len, RP2040UARTState),
+        VMSTATE_UINT32(tx_fifo_rd, RP2040UARTState),
+        VMSTATE_UINT32(tx_fifo_wr, RP2040UARTState),
+        VMSTATE_RP2040_EVENT(tx_timer, RP2040UARTState),
+        VMSTATE_RP2040_EVENT(rx_timer, RP2040UARTState),
+        VMSTATE_RP2040_EVENT(rt_timer, RP2040UARTState),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * const []) {
+        &vmstate_rp2040_uart_expect_state,
+        NULL
     }
 };
 
 static Property rp2040_uart_properties[] = {
     DEFINE_PROP_CHR("chardev", RP2040UARTState, chr),
+    DEFINE_PROP_STRING("pacing", RP2040UARTState, pacing_str),
+    DEFINE_PROP_UINT32("clock-frequency", RP2040UARTState, clk_freq,
+                       125000000),
+    DEFINE_PROP_UINT32("rx-staging-size", RP2040UARTState, rx_stage_size, 0),
+    DEFINE_PROP_BOOL("tx-async", RP2040UARTState, tx_async, false),
+    DEFINE_PROP_STRING("capture", RP2040UARTState, capture_path),
+    DEFINE_PROP_STRING("expect", RP2040UARTState, expect_path),
+    DEFINE_PROP_BOOL("poll-fast-forward", RP2040UARTState, poll_ff, false),
+    DEFINE_PROP_LINK("scheduler", RP2040UARTState, sched, TYPE_RP2040_SCHED,
+                     RP2040SchedState *),
+    DEFINE_PROP_UINT32("tx-async-size", RP2040UARTState, tx_ring_size,
+                       1024 * 1024),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -371,6 +1200,7 @@ static void rp2040_uart_class_init(ObjectClass *klass, void *data)
     DeviceClass *dc = DEVICE_CLASS(klass);
     
     dc->realize = rp2040_uart_realize;
+    dc->unrealize = rp2040_uart_unrealize;
     dc->reset = rp2040_uart_reset;
     dc->vmsd = &vmstate_rp2040_uart;
     device_class_set_props(dc, rp2040_uart_properties);
@@ -0,0 +1,454 @@
+/*
+ * RP2040 UART expectation scripts
+ *
+ * A script lists patterns the firmware's TX output must produce, in
+ * order, each by a deadline in guest time, and patterns it must never
+ * produce.  Matching runs on every byte the guest writes, so QEMU exits
+ * with a verdict as soon as it is known, without help from the firmware.
+ *
+ * One directive per line; blank lines and lines starting with '#' are
+ * ignored:
+ *
+ *   <ms> lit <text>     <text> appears by <ms> of guest time
+ *   <ms> re <regex>     a match of <regex> appears by <ms> of guest time
+ *   fail lit <text>     <text> must never appear
+ *   fail re <regex>     <regex> must never match within a line
+ *
+ * Literals take C escapes such as \n, except for NUL.  Literals are
+ * matched as each byte arrives and regexes at the end of each line, and
+ * once more at the deadline for output that does not end in a newline.
+ * Each step only sees output after the previous step's match.
+ *
+ * Deadlines count from the last reset, which starts the script over.  The
+ * match state is part of the UART's vmstate, so a test run rewound to its
+ * checkpoint picks the script up where it was at the checkpoint.
+ *
+ * Copyright (c) 2025 QEMU RP2040 Development Team
+ *
+ * This code is licensed under the GPL version 2 or later.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "hw/char/rp2040_uart_expect.h"
+#include "migration/vmstate.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "sysemu/runstate.h"
+
+/* Bytes of output quoted in a failure report */
+#define EXPECT_REPORT_TAIL  80
+
+typedef struct RP2040ExpectPattern {
+    char *text;             /* the literal, or the regex source */
+    size_t len;             /* length of a literal */
+    GRegex *regex;          /* NULL for a literal */
+    int64_t deadline_ns;    /* guest time, for steps */
+    int lineno;
+} RP2040ExpectPattern;
+
+static void rp2040_expect_pattern_clear(gpointer data)
+{
+    RP2040ExpectPattern *p = data;
+    
+    g_free(p->text);
+    if (p->regex) {
+        g_regex_unref(p->regex);
+    }
+}
+
+/*
+ * Find p in buf[from, len).  On a match, *end is set to the offset just
+ * after it.
+ */
+static bool rp2040_expect_search(RP2040ExpectPattern *p, const char *buf,
+                                 size_t len, size_t from, size_t *end)
+{
+    GMatchInfo *info;
+    bool found;
+    gint pos;
+    
+    if (!p->regex) {
+        const char *m = p->len <= len - from ?
+                        memmem(buf + from, len - from, p->text, p->len) :
+                        NULL;
+        
+        if (m) {
+            *end = m - buf + p->len;
+        }
+        return m != NULL;
+    }
+    
+    found = g_regex_match_full(p->regex, buf, len, from, 0, &info, NULL);
+    if (found) {
+        g_match_info_fetch_pos(info, 0, NULL, &pos);
+        *end = pos;
+    }
+    g_match_info_free(info);
+    
+    return found;
+}
+
+static void rp2040_expect_describe(RP2040ExpectPattern *p, GString *out)
+{
+    g_autofree char *text = g_strescape(p->text, NULL);
+    
+    g_string_append_printf(out, "line %d: %s \"%s\"", p->lineno,
+                           p->regex ? "re" : "lit", text);
+}
+
+static void rp2040_expect_verdict(RP2040UARTExpect *ex, int code,
+                                  const char *reason, RP2040ExpectPattern *p)
+{
+    double ms = rp2040_sched_now_ns(ex->sched) / 1e6;
+    g_autoptr(GString) msg = g_string_new(NULL);
+    
+    ex->done = true;
+    rp2040_event_del(&ex->deadline);
+    
+    if (code == RP2040_EXPECT_EXIT_PASS) {
+        info_report("%s expect: PASS, %u steps matched by %.3f ms",
+                    ex->name, ex->steps->len, ms);
+    } else {
+        size_t from = ex->pending->len > EXPECT_REPORT_TAIL ?
+                      ex->pending->len - EXPECT_REPORT_TAIL : 0;
+        g_autofree char *tail = g_strescape(ex->pending->str + from, NULL);
+        
+        g_string_append_printf(msg, "%s (", reason);
+        rp2040_expect_describe(p, msg);
+        error_report("%s expect: FAIL at %.3f ms: %s)", ex->name, ms,
+                     msg->str);
+        error_printf("  output since step %u: \"%s%s\"\n", ex->step,
+                     from ? "..." : "", tail);
+    }
+    
+    qemu_system_shutdown_request_with_code(SHUTDOWN_CAUSE_GUEST_SHUTDOWN,
+                                           code);
+}
+
+/*
+ * Match as many steps as the pending output allows.  A literal is only
+ * looked for where it could end at the newest byte, unless the step has
+ * just become pending.  Regexes are only tried at a line end.
+ */
+static void rp2040_expect_advance(RP2040UARTExpect *ex, bool eol)
+{
+    bool fresh = false;
+    
+    while (ex->step < ex->steps->len) {
+        RP2040ExpectPattern *p = &g_array_index(ex->steps,
+                                                RP2040ExpectPattern,
+                                                ex->step);
+        size_t from = 0;
+        size_t end;
+        
+        if (p->regex && !eol) {
+            return;
+        }
+        if (!p->regex && !fresh && ex->pending->len > p->len) {
+            from = ex->pending->len - p->len;
+        }
+        if (!rp2040_expect_search(p, ex->pending->str, ex->pending->len,
+                                  from, &end)) {
+            return;
+        }
+        
+        g_string_erase(ex->pending, 0, end);
+        if (++ex->step == ex->steps->len) {
+            rp2040_expect_verdict(ex, RP2040_EXPECT_EXIT_PASS, NULL, NULL);
+            return;
+        }
+        rp2040_event_mod(&ex->deadline, ex->base_ns +
+                         g_array_index(ex->steps, RP2040ExpectPattern,
+                                       ex->step).deadline_ns);
+        fresh = true;
+    }
+}
+
+static void rp2040_expect_check_fails(RP2040UARTExpect *ex, bool eol)
+{
+    for (guint i = 0; i < ex->fails->len && !ex->done; i++) {
+        RP2040ExpectPattern *p = &g_array_index(ex->fails,
+                                                RP2040ExpectPattern, i);
+        size_t from = 0;
+        size_t end;
+        
+        if (p->regex && !eol) {
+            continue;
+        }
+        if (!p->regex && ex->line->len > p->len) {
+            from = ex->line->len - p->len;
+        }
+        if (rp2040_expect_search(p, ex->line->str, ex->line->len, from,
+                                 &end)) {
+            rp2040_expect_verdict(ex, RP2040_EXPECT_EXIT_MISMATCH,
+                                  "fail pattern matched", p);
+        }
+    }
+}
+
+static void rp2040_expect_deadline_cb(void *opaque)
+{
+    RP2040UARTExpect *ex = opaque;
+    uint32_t step = ex->step;
+    
+    /* Give a regex one last go at a line that has not ended yet */
+    rp2040_expect_advance(ex, true);
+    if (!ex->done && ex->step == step) {
+        rp2040_expect_verdict(ex, RP2040_EXPECT_EXIT_TIMEOUT,
+                              "deadline missed",
+                              &g_array_index(ex->steps, RP2040ExpectPattern,
+                                             step));
+    }
+}
+
+void rp2040_uart_expect_feed(RP2040UARTExpect *ex, uint8_t ch)
+{
+    bool eol = ch == '\n';
+    
+    if (ex->done) {
+        return;
+    }
+    
+    g_string_append_c(ex->pending, ch);
+    if (ex->pending->len > RP2040_EXPECT_BUF_MAX) {
+        g_string_erase(ex->pending, 0,
+                       ex->pending->len - RP2040_EXPECT_BUF_MAX);
+    }
+    g_string_append_c(ex->line, ch);
+    if (ex->line->len > RP2040_EXPECT_BUF_MAX) {
+        g_string_erase(ex->line, 0, ex->line->len - RP2040_EXPECT_BUF_MAX);
+    }
+    
+    rp2040_expect_check_fails(ex, eol);
+    if (!ex->done) {
+        rp2040_expect_advance(ex, eol);
+    }
+    if (eol) {
+        g_string_truncate(ex->line, 0);
+    }
+}
+
+/*
+ * Whether an escape in a literal stands for NUL, as the octal ones of
+ * g_strcompress() can; the compressed text would end there
+ */
+static bool rp2040_expect_escapes_nul(const char *text)
+{
+    while ((text = strchr(text, '\\')) && text[1]) {
+        unsigned int value = 0;
+        int digits = 0;
+        
+        text++;
+        while (digits < 3 && *text >= '0' && *text <= '7') {
+            value = value * 8 + (*text++ - '0');
+            digits++;
+        }
+        if (digits && !(value & 0xff)) {
+            return true;
+        }
+        if (!digits) {
+            text++;
+        }
+    }
+    
+    return false;
+}
+
+static bool rp2040_expect_parse_line(RP2040UARTExpect *ex, char *line,
+                                     int lineno, const char *path,
+                                     Error **errp)
+{
+    RP2040ExpectPattern p = { .lineno = lineno };
+    g_autoptr(GError) gerr = NULL;
+    const char *rest = line;
+    bool fail = false;
+    uint64_t ms = 0;
+    
+    if (g_str_has_prefix(rest, "fail ")) {
+        fail = true;
+        rest += 5;
+    } else if (qemu_strtou64(rest, &rest, 10, &ms) < 0 || *rest != ' ' ||
+               ms > INT64_MAX / SCALE_MS) {
+        error_setg(errp, "%s:%d: expected a deadline in ms or 'fail'",
+                   path, lineno);
+        return false;
+    } else {
+        rest++;
+    }
+    
+    if (g_str_has_prefix(rest, "lit ")) {
+        if (rp2040_expect_escapes_nul(rest + 4)) {
+            error_setg(errp, "%s:%d: literals cannot hold NUL", path, lineno);
+            return false;
+        }
+        p.text = g_strcompress(rest + 4);
+        p.len = strlen(p.text);
+    } else if (g_str_has_prefix(rest, "re ")) {
+        p.text = g_strdup(rest + 3);
+        p.regex = g_regex_new(p.text, G_REGEX_RAW | G_REGEX_MULTILINE |
+                              G_REGEX_OPTIMIZE, 0, &gerr);
+        if (!p.regex) {
+            error_setg(errp, "%s:%d: bad regex: %s", path, lineno,
+                       gerr->message);
+            g_free(p.text);
+            return false;
+        }
+    } else {
+        error_setg(errp, "%s:%d: expected 'lit' or 're'", path, lineno);
+        return false;
+    }
+    if (!*p.text) {
+        error_setg(errp, "%s:%d: empty pattern", path, lineno);
+        rp2040_expect_pattern_clear(&p);
+        return false;
+    }
+    
+    if (fail) {
+        g_array_append_val(ex->fails, p);
+        return true;
+    }
+    
+    p.deadline_ns = ms * SCALE_MS;
+    if (ex->steps->len &&
+        p.deadline_ns < g_array_index(ex->steps, RP2040ExpectPattern,
+                                      ex->steps->len - 1).deadline_ns) {
+        error_setg(errp, "%s:%d: deadline is earlier than the previous "
+                   "step's", path, lineno);
+        rp2040_expect_pattern_clear(&p);
+        return false;
+    }
+    g_array_append_val(ex->steps, p);
+    return true;
+}
+
+RP2040UARTExpect *rp2040_uart_expect_new(const char *name, const char *path,
+                                         RP2040SchedState *sched,
+                                         Error **errp)
+{
+    g_autoptr(GError) gerr = NULL;
+    g_autofree char *contents = NULL;
+    g_auto(GStrv) lines = NULL;
+    RP2040UARTExpect *ex;
+    
+    if (!g_file_get_contents(path, &contents, NULL, &gerr)) {
+        error_setg(errp, "rp2040-uart: cannot read expect script: %s",
+                   gerr->message);
+        return NULL;
+    }
+    
+    ex = g_new0(RP2040UARTExpect, 1);
+    ex->name = g_strdup(name);
+    ex->sched = sched;
+    ex->steps = g_array_new(false, true, sizeof(RP2040ExpectPattern));
+    ex->fails = g_array_new(false, true, sizeof(RP2040ExpectPattern));
+    g_array_set_clear_func(ex->steps, rp2040_expect_pattern_clear);
+    g_array_set_clear_func(ex->fails, rp2040_expect_pattern_clear);
+    ex->pending = g_string_new(NULL);
+    ex->line = g_string_new(NULL);
+    rp2040_event_init_watchdog(&ex->deadline, sched,
+                               rp2040_expect_deadline_cb, ex);
+    
+    lines = g_strsplit(contents, "\n", -1);
+    for (int i = 0; lines[i]; i++) {
+        size_t len = strlen(lines[i]);
+        
+        if (len && lines[i][len - 1] == '\r') {
+            lines[i][len - 1] = '\0';
+        }
+        if (!lines[i][0] || lines[i][0] == '#') {
+            continue;
+        }
+        if (!rp2040_expect_parse_line(ex, lines[i], i + 1, path, errp)) {
+            rp2040_uart_expect_free(ex);
+            return NULL;
+        }
+    }
+    
+    rp2040_uart_expect_reset(ex);
+    
+    return ex;
+}
+
+/* Start the script over, with deadlines counting from now */
+void rp2040_uart_expect_reset(RP2040UARTExpect *ex)
+{
+    ex->step = 0;
+    ex->done = false;
+    ex->base_ns = rp2040_sched_now_ns(ex->sched);
+    g_string_truncate(ex->pending, 0);
+    g_string_truncate(ex->line, 0);
+    
+    if (ex->steps->len) {
+        rp2040_event_mod(&ex->deadline, ex->base_ns +
+                         g_array_index(ex->steps, RP2040ExpectPattern,
+                                       0).deadline_ns);
+    } else {
+        rp2040_event_del(&ex->deadline);
+    }
+}
+
+void rp2040_uart_expect_free(RP2040UARTExpect *ex)
+{
+    if (!ex) {
+        return;
+    }
+    rp2040_event_del(&ex->deadline);
+    g_array_unref(ex->steps);
+    g_array_unref(ex->fails);
+    g_string_free(ex->pending, true);
+    g_string_free(ex->line, true);
+    g_free(ex->name);
+    g_free(ex);
+}
+
+static int rp2040_uart_expect_pre_save(void *opaque)
+{
+    RP2040UARTExpect *ex = opaque;
+    
+    ex->mig_pending_len = ex->pending->len;
+    memcpy(ex->mig_pending, ex->pending->str, ex->pending->len);
+    ex->mig_line_len = ex->line->len;
+    memcpy(ex->mig_line, ex->line->str, ex->line->len);
+    
+    return 0;
+}
+
+static int rp2040_uart_expect_post_load(void *opaque, int version_id)
+{
+    RP2040UARTExpect *ex = opaque;
+    
+    if (ex->step > ex->steps->len ||
+        ex->mig_pending_len > RP2040_EXPECT_BUF_MAX ||
+        ex->mig_line_len > RP2040_EXPECT_BUF_MAX) {
+        return -EINVAL;
+    }
+    g_string_truncate(ex->pending, 0);
+    g_string_append_len(ex->pending, (char *)ex->mig_pending,
+                        ex->mig_pending_len);
+    g_string_truncate(ex->line, 0);
+    g_string_append_len(ex->line, (char *)ex->mig_line, ex->mig_line_len);
+    
+    return 0;
+}
+
+/* The script itself is not migrated; both sides must use the same one */
+const VMStateDescription vmstate_rp2040_uart_expect = {
+    .name = "rp2040-uart-expect",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = rp2040_uart_expect_pre_save,
+    .post_load = rp2040_uart_expect_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(step, RP2040UARTExpect),
+        VMSTATE_INT64(base_ns, RP2040UARTExpect),
+        VMSTATE_BOOL(done, RP2040UARTExpect),
+        VMSTATE_RP2040_EVENT(deadline, RP2040UARTExpect),
+        VMSTATE_UINT32(mig_pending_len, RP2040UARTExpect),
+        VMSTATE_BUFFER(mig_pending, RP2040UARTExpect),
+        VMSTATE_UINT32(mig_line_len, RP2040UARTExpect),
+        VMSTATE_BUFFER(mig_line, RP2040UARTExpect),
+        VMSTATE_END_OF_LIST()
+    }
+};
\ No newline at end of file
@@ -11,7 +11,14 @@
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "migration/vmstate.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
 #include "qemu/log.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "sysemu/runstate.h"
 #include "trace.h"
 
 #define GPIO_NUM_PINS 30
@@ -88,28 +95,720 @@
 #define INT_EDGE_LOW        (1 << 2)
 #define INT_EDGE_HIGH       (1 << 3)
 
+/* STATUS bits reflecting the pad */
+#define STATUS_OUTTOPAD     (1 << 9)
+#define STATUS_OETOPAD      (1 << 13)
+#define STATUS_INFROMPAD    (1 << 17)
+
+/*
+ * VCD recorder ring, in events; the writer is woken at a quarter full, and
+ * every VCD_KICK_PERIOD_MS of host time so slow traces still reach disk
+ */
+#define VCD_RING_SIZE       65536
+#define VCD_KICK_LEVEL      (VCD_RING_SIZE / 4)
+#define VCD_KICK_PERIOD_MS  200
+#define VCD_BUF_SIZE        (1 * MiB)
+
+/*
+ * Interrupt state is kept as 4-bit fields per pin, 8 pins per register.
+ * spread8() moves bit n of an 8-bit pin mask to bit 4 * n so that all
+ * pins of a register can be evaluated with a handful of word operations.
+ */
+static inline uint32_t spread8(uint32_t x)
+{
+    x = (x | (x << 12)) & 0x000F000F;
+    x = (x | (x << 6)) & 0x03030303;
+    x = (x | (x << 3)) & 0x11111111;
+    return x;
+}
+
+/* Recompute the cached per-core pending summary for one INTR register */
+static void rp2040_gpio_update_reg(RP2040GPIOState *s, int reg)
+{
+    uint32_t bit = 1 << reg;
+    
+    if (s->intr[reg] & s->proc0_inte[reg]) {
+        s->proc_pending[0] |= bit;
+    } else {
+        s->proc_pending[0] &= ~bit;
+    }
+    if (s->intr[reg] & s->proc1_inte[reg]) {
+        s->proc_pending[1] |= bit;
+    } else {
+        s->proc_pending[1] &= ~bit;
+    }
+}
+
 static void rp2040_gpio_update_irq(RP2040GPIOState *s)
 {
-    uint32_t proc0_status = 0;
-    uint32_t proc1_status = 0;
+    qemu_set_irq(s->proc0_irq, s->proc_pending[0] != 0);
+    qemu_set_irq(s->proc1_irq, s->proc_pending[1] != 0);
+}
+
+/* Refresh the interrupt sense bits of one pin after a CTRL write */
+static void rp2040_gpio_update_sense(RP2040GPIOState *s, int pin)
+{
+    int reg = pin / 8;
+    int bit = (pin % 8) * 4;
+    uint32_t sense = 0;
     
-    /* Check each GPIO pin for interrupts */
-    for (int i = 0; i < GPIO_NUM_PINS; i++) {
-        int reg = i / 8;
-        int bit = (i % 8) * 4;
+    if ((s->ctrl[pin] & 0x1F) == FUNCSEL_SIO) {
+        sense = (s->ctrl[pin] >> 28) & 0xF;
+    }
+    s->irq_sense[reg] = (s->irq_sense[reg] & ~(0xF << bit)) | (sense << bit);
+}
+
+/*
+ * VCD recorder.  Changes are queued with their virtual timestamp in a
+ * single-producer/single-consumer ring and written out by a background
+ * thread.  The producer only wakes the writer when the ring reaches
+ * VCD_KICK_LEVEL, so recording an edge is a store and two atomics.
+ * Pin words carry the full 30-bit state, so an event lost to a full ring
+ * only hides the intermediate edges, not the final level.
+ *
+ * VCD time must not go backwards, but guest time does when a snapshot or
+ * test checkpoint is loaded.  The recording then carries on from the last
+ * timestamp written, shifted by vcd_time_offset.
+ */
+static void rp2040_gpio_vcd_push(RP2040GPIOState *s, uint8_t kind,
+                                 uint8_t pin, uint32_t value)
+{
+    uint32_t head = s->vcd_head;
+    uint32_t tail = qatomic_load_acquire(&s->vcd_tail);
+    uint64_t now = rp2040_sched_now_ns(s->sched) + s->vcd_time_offset;
+    RP2040GPIOTraceEvent *ev;
+    
+    if (now < s->vcd_last_time) {
+        s->vcd_time_offset += s->vcd_last_time - now;
+        now = s->vcd_last_time;
+    }
+    s->vcd_last_time = now;
+    
+    if (head - tail == VCD_RING_SIZE) {
+        s->vcd_dropped++;
+        qemu_event_set(&s->vcd_event);
+        return;
+    }
+    
+    ev = &s->vcd_ring[head & (VCD_RING_SIZE - 1)];
+    ev->time = now;
+    ev->value = value;
+    ev->kind = kind;
+    ev->pin = pin;
+    qatomic_store_release(&s->vcd_head, head + 1);
+    
+    if (head + 1 - tail == VCD_KICK_LEVEL || kind == RP2040_GPIO_EV_END) {
+        qemu_event_set(&s->vcd_event);
+    }
+}
+
+static inline void rp2040_gpio_vcd_record(RP2040GPIOState *s, uint8_t kind,
+                                          uint8_t pin, uint32_t value)
+{
+    if (unlikely(s->vcd_ring)) {
+        rp2040_gpio_vcd_push(s, kind, pin, value);
+    }
+}
+
+/* Signals are numbered kind * GPIO_NUM_PINS + pin */
+static const char *const vcd_signal_names[] = {
+    [RP2040_GPIO_EV_IN] = "in",
+    [RP2040_GPIO_EV_OUT] = "out",
+    [RP2040_GPIO_EV_OE] = "oe",
+    [RP2040_GPIO_EV_FUNCSEL] = "funcsel",
+};
+
+/* VCD identifier codes are strings over the printable range '!'..'~' */
+static const char *rp2040_gpio_vcd_id(char *buf, int index)
+{
+    char *p = buf;
+    
+    do {
+        *p++ = '!' + index % 94;
+        index /= 94;
+    } while (index);
+    *p = '\0';
+    
+    return buf;
+}
+
+static void rp2040_gpio_vcd_header(FILE *f)
+{
+    char id[4];
+    
+    fprintf(f, "$version QEMU rp2040-gpio $end\n"
+               "$timescale 1ns $end\n"
+               "$scope module rp2040_gpio $end\n");
+    for (int kind = 0; kind <= RP2040_GPIO_EV_FUNCSEL; kind++) {
+        for (int pin = 0; pin < GPIO_NUM_PINS; pin++) {
+            fprintf(f, "$var wire %d %s gpio%d_%s $end\n",
+                    kind == RP2040_GPIO_EV_FUNCSEL ? 5 : 1,
+                    rp2040_gpio_vcd_id(id, kind * GPIO_NUM_PINS + pin),
+                    pin, vcd_signal_names[kind]);
+        }
+    }
+    fprintf(f, "$upscope $end\n"
+               "$enddefinitions $end\n"
+               "#0\n"
+               "$dumpvars\n");
+    for (int kind = 0; kind < RP2040_GPIO_EV_FUNCSEL; kind++) {
+        for (int pin = 0; pin < GPIO_NUM_PINS; pin++) {
+            fprintf(f, "0%s\n",
+                    rp2040_gpio_vcd_id(id, kind * GPIO_NUM_PINS + pin));
+        }
+    }
+    for (int pin = 0; pin < GPIO_NUM_PINS; pin++) {
+        fprintf(f, "b11111 %s\n", rp2040_gpio_vcd_id(
+                    id, RP2040_GPIO_EV_FUNCSEL * GPIO_NUM_PINS + pin));
+    }
+    fprintf(f, "$end\n");
+}
+
+static void *rp2040_gpio_vcd_thread(void *opaque)
+{
+    RP2040GPIOState *s = opaque;
+    FILE *f = s->vcd_file;
+    uint32_t words[RP2040_GPIO_EV_FUNCSEL] = { 0 };
+    uint8_t funcsel[GPIO_NUM_PINS];
+    uint64_t last_time = 0;
+    char id[4];
+    
+    memset(funcsel, FUNCSEL_NULL, sizeof(funcsel));
+    rp2040_gpio_vcd_header(f);
+    
+    for (;;) {
+        uint32_t tail = s->vcd_tail;
+        uint32_t head;
+        
+        qemu_event_reset(&s->vcd_event);
+        head = qatomic_load_acquire(&s->vcd_head);
+        if (head == tail) {
+            if (qatomic_read(&s->vcd_stop)) {
+                break;
+            }
+            /* Caught up: make what was written so far visible on disk */
+            fflush(f);
+            qemu_event_wait(&s->vcd_event);
+            continue;
+        }
         
-        if (s->intr[reg] & (0xF << bit)) {
-            if (s->proc0_inte[reg] & (0xF << bit)) {
-                proc0_status = 1;
+        for (; tail != head; tail++) {
+            const RP2040GPIOTraceEvent *ev =
+                &s->vcd_ring[tail & (VCD_RING_SIZE - 1)];
+            uint32_t changed;
+            
+            if (ev->time != last_time) {
+                fprintf(f, "#%" PRIu64 "\n", ev->time);
+                last_time = ev->time;
+            }
+            
+            switch (ev->kind) {
+            case RP2040_GPIO_EV_IN:
+            case RP2040_GPIO_EV_OUT:
+            case RP2040_GPIO_EV_OE:
+                changed = words[ev->kind] ^ ev->value;
+                words[ev->kind] = ev->value;
+                while (changed) {
+                    int pin = ctz32(changed);
+                    
+                    changed &= changed - 1;
+                    fprintf(f, "%c%s\n", (ev->value >> pin) & 1 ? '1' : '0',
+                            rp2040_gpio_vcd_id(
+                                id, ev->kind * GPIO_NUM_PINS + pin));
+                }
+                break;
+            case RP2040_GPIO_EV_FUNCSEL:
+                if (funcsel[ev->pin] == ev->value) {
+                    break;
+                }
+                funcsel[ev->pin] = ev->value;
+                fprintf(f, "b");
+                for (int bit = 4; bit >= 0; bit--) {
+                    fputc((ev->value >> bit) & 1 ? '1' : '0', f);
+                }
+                fprintf(f, " %s\n", rp2040_gpio_vcd_id(
+                            id, RP2040_GPIO_EV_FUNCSEL * GPIO_NUM_PINS +
+                            ev->pin));
+                break;
+            default:
+                break;
+            }
+        }
+        qatomic_store_release(&s->vcd_tail, tail);
+    }
+    
+    return NULL;
+}
+
+/* Wake the writer now and then even if the ring is far from full */
+static void rp2040_gpio_vcd_kick(void *opaque)
+{
+    RP2040GPIOState *s = opaque;
+    
+    if (qatomic_read(&s->vcd_head) != qatomic_read(&s->vcd_tail)) {
+        qemu_event_set(&s->vcd_event);
+    }
+    timer_mod(s->vcd_kick, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+              VCD_KICK_PERIOD_MS);
+}
+
+static bool rp2040_gpio_vcd_open(RP2040GPIOState *s, Error **errp)
+{
+    s->vcd_file = fopen(s->vcd_path, "w");
+    if (!s->vcd_file) {
+        error_setg_file_open(errp, errno, s->vcd_path);
+        return false;
+    }
+    setvbuf(s->vcd_file, NULL, _IOFBF, VCD_BUF_SIZE);
+    
+    s->vcd_ring = g_new0(RP2040GPIOTraceEvent, VCD_RING_SIZE);
+    s->vcd_head = 0;
+    s->vcd_tail = 0;
+    s->vcd_time_offset = 0;
+    s->vcd_last_time = 0;
+    s->vcd_stop = false;
+    qemu_event_init(&s->vcd_event, false);
+    qemu_thread_create(&s->vcd_thread, "rp2040-gpio-vcd",
+                       rp2040_gpio_vcd_thread, s, QEMU_THREAD_JOINABLE);
+    s->vcd_kick = timer_new_ms(QEMU_CLOCK_REALTIME, rp2040_gpio_vcd_kick, s);
+    timer_mod(s->vcd_kick, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+              VCD_KICK_PERIOD_MS);
+    
+    return true;
+}
+
+/* Mark the end time, let the writer drain the ring and close the file */
+static void rp2040_gpio_vcd_close(RP2040GPIOState *s)
+{
+    if (!s->vcd_ring) {
+        return;
+    }
+    
+    timer_free(s->vcd_kick);
+    s->vcd_kick = NULL;
+    rp2040_gpio_vcd_push(s, RP2040_GPIO_EV_END, 0, 0);
+    qatomic_set(&s->vcd_stop, true);
+    qemu_event_set(&s->vcd_event);
+    qemu_thread_join(&s->vcd_thread);
+    qemu_event_destroy(&s->vcd_event);
+    
+    if (s->vcd_dropped) {
+        warn_report("rp2040-gpio: VCD recorder dropped %" PRIu64 " events",
+                    s->vcd_dropped);
+    }
+    fclose(s->vcd_file);
+    s->vcd_file = NULL;
+    g_free(s->vcd_ring);
+    s->vcd_ring = NULL;
+}
+
+/*
+ * Stimulus playback.  The file is memory-mapped and parsed one event
+ * ahead of virtual time, so arbitrarily large captures stream through a
+ * bounded working set.  Two formats are accepted:
+ *
+ *  - CSV, one "time_ns,pin,level" per line; '#' starts a comment and
+ *    lines not starting with a digit (e.g. a header) are skipped
+ *  - VCD, where 1-bit variables named gpioN or gpioN_in drive pin N
+ *
+ * Times are relative to the last reset.  A single event applies all
+ * events that share a timestamp as one rp2040_gpio_set_input_mask() call.
+ */
+static inline bool stim_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* Return the next whitespace-delimited token, or 0 at end of file */
+static size_t rp2040_gpio_stim_token(RP2040GPIOState *s, const char **tok)
+{
+    const char *p = s->stim_pos;
+    const char *end = s->stim_end;
+    
+    while (p < end && stim_is_space(*p)) {
+        p++;
+    }
+    *tok = p;
+    while (p < end && !stim_is_space(*p)) {
+        p++;
+    }
+    s->stim_pos = p;
+    
+    return p - *tok;
+}
+
+static bool rp2040_gpio_stim_token_is(const char *tok, size_t len,
+                                      const char *str)
+{
+    return len == strlen(str) && !memcmp(tok, str, len);
+}
+
+/* Skip tokens up to and including the next "$end" */
+static void rp2040_gpio_stim_skip_end(RP2040GPIOState *s)
+{
+    const char *tok;
+    size_t len;
+    
+    while ((len = rp2040_gpio_stim_token(s, &tok)) != 0) {
+        if (rp2040_gpio_stim_token_is(tok, len, "$end")) {
+            break;
+        }
+    }
+}
+
+static bool rp2040_gpio_stim_parse_u64(const char **pp, const char *end,
+                                       uint64_t *val)
+{
+    const char *p = *pp;
+    uint64_t v = 0;
+    
+    if (p == end || !g_ascii_isdigit(*p)) {
+        return false;
+    }
+    while (p < end && g_ascii_isdigit(*p)) {
+        v = v * 10 + (*p - '0');
+        p++;
+    }
+    *pp = p;
+    *val = v;
+    
+    return true;
+}
+
+static void rp2040_gpio_stim_error(RP2040GPIOState *s, const char *msg)
+{
+    warn_report("rp2040-gpio: stimulus '%s' at offset %td: %s; "
+                "playback stopped", s->stim_path,
+                s->stim_pos - g_mapped_file_get_contents(s->stim_file), msg);
+    s->stim_pos = s->stim_end;
+}
+
+static bool rp2040_gpio_stim_next_csv(RP2040GPIOState *s)
+{
+    const char *end = s->stim_end;
+    
+    while (s->stim_pos < end) {
+        const char *p = s->stim_pos;
+        uint64_t time, pin, level;
+        
+        while (p < end && stim_is_space(*p)) {
+            p++;
+        }
+        s->stim_pos = p;
+        if (p == end) {
+            break;
+        }
+        
+        if (!g_ascii_isdigit(*p)) {
+            /* Comment or header line */
+            p = memchr(p, '\n', end - p);
+            s->stim_pos = p ? p + 1 : end;
+            continue;
+        }
+        
+        if (!rp2040_gpio_stim_parse_u64(&p, end, &time) ||
+            p == end || *p++ != ',' ||
+            !rp2040_gpio_stim_parse_u64(&p, end, &pin) ||
+            p == end || *p++ != ',' ||
+            !rp2040_gpio_stim_parse_u64(&p, end, &level)) {
+            rp2040_gpio_stim_error(s, "expected time,pin,level");
+            return false;
+        }
+        p = memchr(p, '\n', end - p);
+        s->stim_pos = p ? p + 1 : end;
+        
+        if (pin >= GPIO_NUM_PINS) {
+            continue;
+        }
+        s->stim_ev_time = time;
+        s->stim_ev_pin = pin;
+        s->stim_ev_level = level != 0;
+        return true;
+    }
+    
+    return false;
+}
+
+static bool rp2040_gpio_stim_next_vcd(RP2040GPIOState *s)
+{
+    const char *tok;
+    size_t len;
+    
+    while ((len = rp2040_gpio_stim_token(s, &tok)) != 0) {
+        char id[16];
+        gpointer pin;
+        
+        switch (tok[0]) {
+        case '#': {
+            const char *p = tok + 1;
+            uint64_t time;
+            
+            if (!rp2040_gpio_stim_parse_u64(&p, tok + len, &time)) {
+                rp2040_gpio_stim_error(s, "bad timestamp");
+                return false;
+            }
+            if (time > UINT64_MAX / s->stim_ts_mul) {
+                rp2040_gpio_stim_error(s, "timestamp out of range");
+                return false;
+            }
+            s->stim_vcd_time = time * s->stim_ts_mul / s->stim_ts_div;
+            break;
+        }
+        case '0':
+        case '1':
+            if (len < 2 || len > sizeof(id)) {
+                break;
+            }
+            memcpy(id, tok + 1, len - 1);
+            id[len - 1] = '\0';
+            pin = g_hash_table_lookup(s->stim_ids, id);
+            if (pin) {
+                s->stim_ev_time = s->stim_vcd_time;
+                s->stim_ev_pin = GPOINTER_TO_INT(pin) - 1;
+                s->stim_ev_level = tok[0] == '1';
+                return true;
+            }
+            break;
+        case 'b':
+        case 'B':
+        case 'r':
+        case 'R':
+            /* Vector and real values are followed by their identifier */
+            rp2040_gpio_stim_token(s, &tok);
+            break;
+        case '$':
+            /* Keywords inside the value change section carry no data */
+            if (rp2040_gpio_stim_token_is(tok, len, "$comment")) {
+                rp2040_gpio_stim_skip_end(s);
+            }
+            break;
+        default:
+            /* x/z states and anything else we do not drive */
+            break;
+        }
+    }
+    
+    return false;
+}
+
+/* Map a VCD reference name of the form gpioN or gpioN_in to a pin */
+static int rp2040_gpio_stim_vcd_pin(const char *ref)
+{
+    const char *p = ref + 4;
+    uint64_t pin;
+    
+    if (g_ascii_strncasecmp(ref, "gpio", 4) ||
+        !rp2040_gpio_stim_parse_u64(&p, p + strlen(p), &pin) ||
+        pin >= GPIO_NUM_PINS) {
+        return -1;
+    }
+    if (*p && strcmp(p, "_in")) {
+        return -1;
+    }
+    
+    return pin;
+}
+
+static bool rp2040_gpio_stim_timescale(RP2040GPIOState *s, Error **errp)
+{
+    static const struct {
+        const char *unit;
+        uint64_t mul;
+        uint64_t div;
+    } units[] = {
+        { "s", 1000000000, 1 }, { "ms", 1000000, 1 }, { "us", 1000, 1 },
+        { "ns", 1, 1 }, { "ps", 1, 1000 }, { "fs", 1, 1000000 },
+    };
+    char buf[16] = "";
+    const char *tok;
+    const char *p;
+    size_t len;
+    uint64_t mag;
+    
+    /* The magnitude and unit may or may not be separated by a space */
+    while ((len = rp2040_gpio_stim_token(s, &tok)) != 0 &&
+           !rp2040_gpio_stim_token_is(tok, len, "$end")) {
+        if (strlen(buf) + len < sizeof(buf)) {
+            strncat(buf, tok, len);
+        }
+    }
+    
+    p = buf;
+    if (!rp2040_gpio_stim_parse_u64(&p, buf + strlen(buf), &mag) ||
+        (mag != 1 && mag != 10 && mag != 100)) {
+        goto bad;
+    }
+    for (int i = 0; i < ARRAY_SIZE(units); i++) {
+        if (!strcmp(p, units[i].unit)) {
+            if (units[i].div == 1) {
+                s->stim_ts_mul = mag * units[i].mul;
+                s->stim_ts_div = 1;
+            } else {
+                s->stim_ts_mul = 1;
+                s->stim_ts_div = units[i].div / mag;
             }
-            if (s->proc1_inte[reg] & (0xF << bit)) {
-                proc1_status = 1;
+            return true;
+        }
+    }
+    
+bad:
+    error_setg(errp, "rp2040-gpio: stimulus '%s': bad $timescale '%s'",
+               s->stim_path, buf);
+    return false;
+}
+
+/* Parse the VCD header up to $enddefinitions */
+static bool rp2040_gpio_stim_vcd_header(RP2040GPIOState *s, Error **errp)
+{
+    const char *tok;
+    size_t len;
+    
+    s->stim_ids = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                        g_free, NULL);
+    
+    while ((len = rp2040_gpio_stim_token(s, &tok)) != 0) {
+        if (rp2040_gpio_stim_token_is(tok, len, "$enddefinitions")) {
+            rp2040_gpio_stim_skip_end(s);
+            return true;
+        } else if (rp2040_gpio_stim_token_is(tok, len, "$timescale")) {
+            if (!rp2040_gpio_stim_timescale(s, errp)) {
+                return false;
+            }
+        } else if (rp2040_gpio_stim_token_is(tok, len, "$var")) {
+            /* $var type size id reference [index] $end */
+            const char *f[4];
+            size_t flen[4];
+            int i;
+            
+            for (i = 0; i < 4; i++) {
+                flen[i] = rp2040_gpio_stim_token(s, &f[i]);
+                if (rp2040_gpio_stim_token_is(f[i], flen[i], "$end")) {
+                    break;
+                }
             }
+            if (i == 4) {
+                g_autofree char *ref = g_strndup(f[3], flen[3]);
+                int pin = rp2040_gpio_stim_vcd_pin(ref);
+                
+                if (pin >= 0 && rp2040_gpio_stim_token_is(f[1], flen[1], "1")) {
+                    g_hash_table_insert(s->stim_ids, g_strndup(f[2], flen[2]),
+                                        GINT_TO_POINTER(pin + 1));
+                }
+                rp2040_gpio_stim_skip_end(s);
+            }
+        } else if (tok[0] == '$') {
+            rp2040_gpio_stim_skip_end(s);
+        }
+    }
+    
+    error_setg(errp, "rp2040-gpio: stimulus '%s': missing $enddefinitions",
+               s->stim_path);
+    return false;
+}
+
+static void rp2040_gpio_stim_fetch(RP2040GPIOState *s)
+{
+    s->stim_have_ev = s->stim_is_vcd ? rp2040_gpio_stim_next_vcd(s)
+                                     : rp2040_gpio_stim_next_csv(s);
+    
+    /* The event is armed at stim_base + stim_ev_time, which must fit */
+    if (s->stim_have_ev && s->stim_ev_time > INT64_MAX - s->stim_base) {
+        rp2040_gpio_stim_error(s, "timestamp out of range");
+        s->stim_have_ev = false;
+    }
+}
+
+static void rp2040_gpio_stim_timer_cb(void *opaque)
+{
+    RP2040GPIOState *s = opaque;
+    uint32_t mask = 0;
+    uint32_t levels = 0;
+    uint64_t time;
+    
+    if (!s->stim_have_ev) {
+        return;
+    }
+    
+    /* Collect every event due at this timestamp into one batch */
+    time = s->stim_ev_time;
+    do {
+        uint32_t bit = 1u << s->stim_ev_pin;
+        
+        mask |= bit;
+        levels = s->stim_ev_level ? levels | bit : levels & ~bit;
+        rp2040_gpio_stim_fetch(s);
+    } while (s->stim_have_ev && s->stim_ev_time <= time);
+    
+    rp2040_gpio_set_input_mask(s, mask, levels);
+    
+    if (s->stim_have_ev) {
+        rp2040_event_mod(&s->stim_timer, s->stim_base + s->stim_ev_time);
+    }
+}
+
+/* Rewind playback so that stimulus time 0 is now */
+static void rp2040_gpio_stim_restart(RP2040GPIOState *s)
+{
+    s->stim_pos = s->stim_start;
+    s->stim_vcd_time = 0;
+    s->stim_base = rp2040_sched_now_ns(s->sched);
+    rp2040_gpio_stim_fetch(s);
+    
+    if (s->stim_have_ev) {
+        rp2040_event_mod(&s->stim_timer, s->stim_base + s->stim_ev_time);
+    } else {
+        rp2040_event_del(&s->stim_timer);
+    }
+}
+
+static bool rp2040_gpio_stim_open(RP2040GPIOState *s, Error **errp)
+{
+    GError *gerr = NULL;
+    
+    s->stim_file = g_mapped_file_new(s->stim_path, FALSE, &gerr);
+    if (!s->stim_file) {
+        error_setg(errp, "rp2040-gpio: cannot map stimulus '%s': %s",
+                   s->stim_path, gerr->message);
+        g_error_free(gerr);
+        return false;
+    }
+    
+    s->stim_start = g_mapped_file_get_contents(s->stim_file);
+    s->stim_size = g_mapped_file_get_length(s->stim_file);
+    s->stim_end = s->stim_start + s->stim_size;
+    s->stim_pos = s->stim_start;
+    s->stim_ts_mul = 1;
+    s->stim_ts_div = 1;
+    
+    /* VCD files start with a header keyword, CSV files never do */
+    while (s->stim_pos < s->stim_end && stim_is_space(*s->stim_pos)) {
+        s->stim_pos++;
+    }
+    s->stim_is_vcd = s->stim_pos < s->stim_end && *s->stim_pos == '$';
+    if (s->stim_is_vcd) {
+        if (!rp2040_gpio_stim_vcd_header(s, errp)) {
+            return false;
         }
+        s->stim_start = s->stim_pos;
     }
     
-    qemu_set_irq(s->proc0_irq, proc0_status);
-    qemu_set_irq(s->proc1_irq, proc1_status);
+    return true;
+}
+
+static void rp2040_gpio_stim_close(RP2040GPIOState *s)
+{
+    if (s->stim_timer.sched) {
+        rp2040_event_del(&s->stim_timer);
+    }
+    if (s->stim_ids) {
+        g_hash_table_destroy(s->stim_ids);
+        s->stim_ids = NULL;
+    }
+    if (s->stim_file) {
+        g_mapped_file_unref(s->stim_file);
+        s->stim_file = NULL;
+    }
+    s->stim_have_ev = false;
 }
 
 static uint64_t rp2040_gpio_read(void *opaque, hwaddr offset, unsigned size)
@@ -124,6 +823,15 @@ static uint64_t rp2040_gpio_read(void *opaque, hwaddr offset, unsigned size)
             if ((offset & 7) == 0) {
                 /* STATUS register */
                 val = s->status[pin];
+                if (s->out_level & (1 << pin)) {
+                    val |= STATUS_OUTTOPAD;
+                }
+                if (s->oe & (1 << pin)) {
+                    val |= STATUS_OETOPAD;
+                }
+                if (s->in_level & (1 << pin)) {
+                    val |= STATUS_INFROMPAD;
+                }
             } else {
                 /* CTRL register */
                 val = s->ctrl[pin];
@@ -237,6 +945,8 @@ static void rp2040_gpio_write(void *opaque, hwaddr offset,
 {
     RP2040GPIOState *s = opaque;
     
+    rp2040_sched_note_write(s->sched, OBJECT(s), offset, value);
+    
     if (offset < 0xF0) {
         /* GPIO control registers */
         int pin = offset / 8;
@@ -245,6 +955,10 @@ static void rp2040_gpio_write(void *opaque, hwaddr offset,
                 /* STATUS register - read only */
             } else {
                 /* CTRL register */
+                if ((s->ctrl[pin] ^ value) & 0x1F) {
+                    rp2040_gpio_vcd_record(s, RP2040_GPIO_EV_FUNCSEL, pin,
+                                           value & 0x1F);
+                }
                 s->ctrl[pin] = value;
                 /* Update function selection */
                 int funcsel = value & 0x1F;
@@ -252,6 +966,7 @@ static void rp2040_gpio_write(void *opaque, hwaddr offset,
                     /* GPIO is under software control */
                     s->status[pin] = (s->status[pin] & ~0x1F) | funcsel;
                 }
+                rp2040_gpio_update_sense(s, pin);
             }
         }
     } else {
@@ -262,23 +977,28 @@ static void rp2040_gpio_write(void *opaque, hwaddr offset,
         case INTR3:
             /* Clear interrupt bits by writing 1 */
             s->intr[(offset - INTR0) / 4] &= ~value;
+            rp2040_gpio_update_reg(s, (offset - INTR0) / 4);
             rp2040_gpio_update_irq(s);
             break;
             
         case PROC0_INTE0:
             s->proc0_inte[0] = value;
+            rp2040_gpio_update_reg(s, 0);
             rp2040_gpio_update_irq(s);
             break;
         case PROC0_INTE1:
             s->proc0_inte[1] = value;
+            rp2040_gpio_update_reg(s, 1);
             rp2040_gpio_update_irq(s);
             break;
         case PROC0_INTE2:
             s->proc0_inte[2] = value;
+            rp2040_gpio_update_reg(s, 2);
             rp2040_gpio_update_irq(s);
             break;
         case PROC0_INTE3:
             s->proc0_inte[3] = value;
+            rp2040_gpio_update_reg(s, 3);
             rp2040_gpio_update_irq(s);
             break;
             
@@ -297,18 +1017,22 @@ static void rp2040_gpio_write(void *opaque, hwaddr offset,
             
         case PROC1_INTE0:
             s->proc1_inte[0] = value;
+            rp2040_gpio_update_reg(s, 0);
             rp2040_gpio_update_irq(s);
             break;
         case PROC1_INTE1:
             s->proc1_inte[1] = value;
+            rp2040_gpio_update_reg(s, 1);
             rp2040_gpio_update_irq(s);
             break;
         case PROC1_INTE2:
             s->proc1_inte[2] = value;
+            rp2040_gpio_update_reg(s, 2);
             rp2040_gpio_update_irq(s);
             break;
         case PROC1_INTE3:
             s->proc1_inte[3] = value;
+            rp2040_gpio_update_reg(s, 3);
             rp2040_gpio_update_irq(s);
             break;
             
@@ -339,54 +1063,106 @@ static const MemoryRegionOps rp2040_gpio_ops = {
     .endianness = DEVICE_LITTLE_ENDIAN,
 };
 
-/* Called from SIO when GPIO state changes */
-void rp2040_gpio_set_input(RP2040GPIOState *s, int pin, int level)
+/*
+ * Drive the input level of every pin in mask to the matching bit of
+ * levels.  Level conditions are sampled for all pins in mask and edges
+ * for the pins that changed, one INTR register (8 pins) at a time.
+ */
+void rp2040_gpio_set_input_mask(RP2040GPIOState *s, uint32_t mask,
+                                uint32_t levels)
 {
-    if (pin >= GPIO_NUM_PINS) {
-        return;
-    }
-    
-    uint32_t old_level = (s->status[pin] >> 17) & 1;
+    uint32_t old_level = s->in_level;
+    uint32_t new_level;
+    uint32_t changed;
+    bool dirty = false;
     
-    /* Update input level in status register */
-    if (level) {
-        s->status[pin] |= (1 << 17);
-    } else {
-        s->status[pin] &= ~(1 << 17);
+    mask &= (1u << GPIO_NUM_PINS) - 1;
+    new_level = (old_level & ~mask) | (levels & mask);
+    changed = old_level ^ new_level;
+    s->in_level = new_level;
+    if (changed) {
+        rp2040_gpio_vcd_record(s, RP2040_GPIO_EV_IN, 0, new_level);
     }
     
-    /* Check for interrupt conditions */
-    int reg = pin / 8;
-    int bit = (pin % 8) * 4;
-    
-    if ((s->ctrl[pin] & 0x1F) == FUNCSEL_SIO) {
-        uint32_t int_mask = (s->ctrl[pin] >> 28) & 0xF;
-        uint32_t int_status = 0;
+    for (int reg = 0; reg < 4; reg++) {
+        int shift = reg * 8;
+        uint32_t m, hi, ch, int_status;
         
-        if ((int_mask & INT_LEVEL_LOW) && !level) {
-            int_status |= INT_LEVEL_LOW;
-        }
-        if ((int_mask & INT_LEVEL_HIGH) && level) {
-            int_status |= INT_LEVEL_HIGH;
-        }
-        if ((int_mask & INT_EDGE_LOW) && old_level && !level) {
-            int_status |= INT_EDGE_LOW;
-        }
-        if ((int_mask & INT_EDGE_HIGH) && !old_level && level) {
-            int_status |= INT_EDGE_HIGH;
+        if (!((mask >> shift) & 0xFF)) {
+            continue;
         }
         
+        m = spread8((mask >> shift) & 0xFF);
+        hi = spread8((new_level >> shift) & 0xFF);
+        ch = spread8((changed >> shift) & 0xFF);
+        
+        int_status = ((m & ~hi) * INT_LEVEL_LOW) |
+                     ((m & hi) * INT_LEVEL_HIGH) |
+                     ((ch & ~hi) * INT_EDGE_LOW) |
+                     ((ch & hi) * INT_EDGE_HIGH);
+        int_status &= s->irq_sense[reg];
+        
         if (int_status) {
-            s->intr[reg] |= (int_status << bit);
-            rp2040_gpio_update_irq(s);
+            s->intr[reg] |= int_status;
+            rp2040_gpio_update_reg(s, reg);
+            dirty = true;
         }
     }
+    
+    if (dirty) {
+        rp2040_gpio_update_irq(s);
+    }
+}
+
+/* Called from SIO when GPIO state changes */
+void rp2040_gpio_set_input(RP2040GPIOState *s, int pin, int level)
+{
+    if (pin < 0 || pin >= GPIO_NUM_PINS) {
+        return;
+    }
+    
+    rp2040_gpio_set_input_mask(s, 1u << pin, level ? 1u << pin : 0);
+}
+
+/* Called from SIO when the output levels it drives change */
+void rp2040_gpio_set_output_mask(RP2040GPIOState *s, uint32_t mask,
+                                 uint32_t levels)
+{
+    uint32_t new_level;
+    
+    mask &= (1u << GPIO_NUM_PINS) - 1;
+    new_level = (s->out_level & ~mask) | (levels & mask);
+    if (new_level != s->out_level) {
+        s->out_level = new_level;
+        rp2040_gpio_vcd_record(s, RP2040_GPIO_EV_OUT, 0, new_level);
+    }
+}
+
+/* Called from SIO when the output enables it drives change */
+void rp2040_gpio_set_oe_mask(RP2040GPIOState *s, uint32_t mask,
+                             uint32_t enables)
+{
+    uint32_t new_oe;
+    
+    mask &= (1u << GPIO_NUM_PINS) - 1;
+    new_oe = (s->oe & ~mask) | (enables & mask);
+    if (new_oe != s->oe) {
+        s->oe = new_oe;
+        rp2040_gpio_vcd_record(s, RP2040_GPIO_EV_OE, 0, new_oe);
+    }
 }
 
 static void rp2040_gpio_reset(DeviceState *dev)
 {
     RP2040GPIOState *s = RP2040_GPIO(dev);
     
+    rp2040_gpio_vcd_record(s, RP2040_GPIO_EV_IN, 0, 0);
+    rp2040_gpio_vcd_record(s, RP2040_GPIO_EV_OUT, 0, 0);
+    rp2040_gpio_vcd_record(s, RP2040_GPIO_EV_OE, 0, 0);
+    for (int i = 0; i < GPIO_NUM_PINS; i++) {
+        rp2040_gpio_vcd_record(s, RP2040_GPIO_EV_FUNCSEL, i, FUNCSEL_NULL);
+    }
+    
     memset(s->status, 0, sizeof(s->status));
     memset(s->ctrl, 0, sizeof(s->ctrl));
     memset(s->intr, 0, sizeof(s->intr));
@@ -394,12 +1170,22 @@ static void rp2040_gpio_reset(DeviceState *dev)
     memset(s->proc0_intf, 0, sizeof(s->proc0_intf));
     memset(s->proc1_inte, 0, sizeof(s->proc1_inte));
     memset(s->proc1_intf, 0, sizeof(s->proc1_intf));
+    memset(s->irq_sense, 0, sizeof(s->irq_sense));
+    s->in_level = 0;
+    s->out_level = 0;
+    s->oe = 0;
+    s->proc_pending[0] = 0;
+    s->proc_pending[1] = 0;
     
     /* Set all pins to NULL function by default */
     for (int i = 0; i < GPIO_NUM_PINS; i++) {
         s->ctrl[i] = FUNCSEL_NULL;
         s->status[i] = FUNCSEL_NULL;
     }
+    
+    if (s->stim_file) {
+        rp2040_gpio_stim_restart(s);
+    }
 }
 
 static void rp2040_gpio_init(Object *obj)
@@ -415,10 +1201,154 @@ static void rp2040_gpio_init(Object *obj)
     sysbus_init_irq(sbd, &s->proc1_irq);
 }
 
-static const VMStateDescription vmstate_rp2040_gpio = {
-    .name = TYPE_RP2040_GPIO,
+static void rp2040_gpio_shutdown_notify(Notifier *notifier, void *data)
+{
+    RP2040GPIOState *s = container_of(notifier, RP2040GPIOState,
+                                      shutdown_notifier);
+    
+    rp2040_gpio_vcd_close(s);
+}
+
+/*
+ * The loaded pin state is not in the recording, which only sees changes.
+ * Write all of it at the rewind, so the trace shows each run from the
+ * state of the checkpoint.
+ */
+static void rp2040_gpio_rewind_notify(Notifier *notifier, void *data)
+{
+    RP2040GPIOState *s = container_of(notifier, RP2040GPIOState,
+                                      rewind_notifier);
+    
+    if (!s->vcd_ring) {
+        return;
+    }
+    rp2040_gpio_vcd_push(s, RP2040_GPIO_EV_IN, 0, s->in_level);
+    rp2040_gpio_vcd_push(s, RP2040_GPIO_EV_OUT, 0, s->out_level);
+    rp2040_gpio_vcd_push(s, RP2040_GPIO_EV_OE, 0, s->oe);
+    for (int i = 0; i < GPIO_NUM_PINS; i++) {
+        rp2040_gpio_vcd_push(s, RP2040_GPIO_EV_FUNCSEL, i,
+                             s->ctrl[i] & 0x1F);
+    }
+}
+
+static void rp2040_gpio_realize(DeviceState *dev, Error **errp)
+{
+    RP2040GPIOState *s = RP2040_GPIO(dev);
+    
+    if (!s->sched) {
+        s->sched = rp2040_sched_create(OBJECT(dev), false, errp);
+        if (!s->sched) {
+            return;
+        }
+    }
+    
+    /* Valid without a stimulus too, so unloading need not check */
+    rp2040_event_init(&s->stim_timer, s->sched, rp2040_gpio_stim_timer_cb, s);
+    if (s->stim_path && !rp2040_gpio_stim_open(s, errp)) {
+        rp2040_gpio_stim_close(s);
+        return;
+    }
+    if (s->vcd_path && !rp2040_gpio_vcd_open(s, errp)) {
+        rp2040_gpio_stim_close(s);
+        return;
+    }
+    
+    s->shutdown_notifier.notify = rp2040_gpio_shutdown_notify;
+    qemu_register_shutdown_notifier(&s->shutdown_notifier);
+    s->rewind_notifier.notify = rp2040_gpio_rewind_notify;
+    rp2040_sched_add_rewind_notifier(s->sched, &s->rewind_notifier);
+}
+
+static void rp2040_gpio_unrealize(DeviceState *dev)
+{
+    RP2040GPIOState *s = RP2040_GPIO(dev);
+    
+    rp2040_gpio_vcd_close(s);
+    rp2040_gpio_stim_close(s);
+    notifier_remove(&s->shutdown_notifier);
+    notifier_remove(&s->rewind_notifier);
+}
+
+static int rp2040_gpio_post_load(void *opaque, int version_id)
+{
+    RP2040GPIOState *s = opaque;
+    
+    /* Rebuild the caches derived from CTRL and the interrupt registers */
+    for (int i = 0; i < GPIO_NUM_PINS; i++) {
+        rp2040_gpio_update_sense(s, i);
+    }
+    for (int reg = 0; reg < 4; reg++) {
+        rp2040_gpio_update_reg(s, reg);
+    }
+    
+    return 0;
+}
+
+/*
+ * Stimulus playback position, so that a rewound test run (or a loaded
+ * snapshot) sees the same input edges again.  The file itself is not
+ * migrated; the destination must have been started with the same one.
+ */
+static bool rp2040_gpio_stim_needed(void *opaque)
+{
+    RP2040GPIOState *s = opaque;
+    
+    return s->stim_file != NULL;
+}
+
+static int rp2040_gpio_stim_pre_save(void *opaque)
+{
+    RP2040GPIOState *s = opaque;
+    
+    s->stim_pos_offset = s->stim_pos - g_mapped_file_get_contents(
+                                           s->stim_file);
+    
+    return 0;
+}
+
+static int rp2040_gpio_stim_post_load(void *opaque, int version_id)
+{
+    RP2040GPIOState *s = opaque;
+    
+    if (!s->stim_file ||
+        s->stim_size != g_mapped_file_get_length(s->stim_file) ||
+        s->stim_pos_offset > s->stim_size) {
+        error_report("rp2040-gpio: stimulus file differs from the one the "
+                     "state was saved with");
+        return -EINVAL;
+    }
+    s->stim_pos = g_mapped_file_get_contents(s->stim_file) +
+                  s->stim_pos_offset;
+    
+    return 0;
+}
+
+static const VMStateDescription vmstate_rp2040_gpio_stim = {
+    .name = TYPE_RP2040_GPIO "/stimulus",
     .version_id = 1,
     .minimum_version_id = 1,
+    .needed = rp2040_gpio_stim_needed,
+    .pre_save = rp2040_gpio_stim_pre_save,
+    .post_load = rp2040_gpio_stim_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(stim_size, RP2040GPIOState),
+        VMSTATE_UINT64(stim_pos_offset, RP2040GPIOState),
+        VMSTATE_UINT64(stim_vcd_time, RP2040GPIOState),
+        VMSTATE_INT64(stim_base, RP2040GPIOState),
+        VMSTATE_BOOL(stim_have_ev, RP2040GPIOState),
+        VMSTATE_UINT64(stim_ev_time, RP2040GPIOState),
+        VMSTATE_UINT32(stim_ev_pin, RP2040GPIOState),
+        VMSTATE_UINT32(stim_ev_level, RP2040GPIOState),
+        VMSTATE_RP2040_EVENT(stim_timer, RP2040GPIOState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_rp2040_gpio = {
+    .name = TYPE_RP2040_GPIO,
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .post_load = rp2040_gpio_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_UINT32_ARRAY(status, RP2040GPIOState, GPIO_NUM_PINS),
         VMSTATE_UINT32_ARRAY(ctrl, RP2040GPIOState, GPIO_NUM_PINS),
@@ -427,16 +1357,32 @@ static const VMStateDescription vmstate_rp2040_gpio = {
         VMSTATE_UINT32_ARRAY(proc0_intf, RP2040GPIOState, 4),
         VMSTATE_UINT32_ARRAY(proc1_inte, RP2040GPIOState, 4),
         VMSTATE_UINT32_ARRAY(proc1_intf, RP2040GPIOState, 4),
+        VMSTATE_UINT32(in_level, RP2040GPIOState),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * const []) {
+        &vmstate_rp2040_gpio_stim,
+        NULL
     }
 };
 
+static Property rp2040_gpio_properties[] = {
+    DEFINE_PROP_STRING("vcd", RP2040GPIOState, vcd_path),
+    DEFINE_PROP_STRING("stimulus", RP2040GPIOState, stim_path),
+    DEFINE_PROP_LINK("scheduler", RP2040GPIOState, sched, TYPE_RP2040_SCHED,
+                     RP2040SchedState *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void rp2040_gpio_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     
+    dc->realize = rp2040_gpio_realize;
+    dc->unrealize = rp2040_gpio_unrealize;
     dc->reset = rp2040_gpio_reset;
     dc->vmsd = &vmstate_rp2040_gpio;
+    device_class_set_props(dc, rp2040_gpio_properties);
 }
 
 static const TypeInfo rp2040_gpio_info = {
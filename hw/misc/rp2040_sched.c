@@ -0,0 +1,515 @@
+/*
+ * RP2040 SoC event scheduler
+ *
+ * Copyright (c) 2025 QEMU RP2040 Development Team
+ *
+ * This code is licensed under the GPL version 2 or later.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "hw/misc/rp2040_sched.h"
+#include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "sysemu/runstate.h"
+
+#define HEAP_INITIAL_SIZE 16
+
+/* Host clock reading, before dilation and offset are applied */
+int64_t rp2040_sched_clock_ns(RP2040SchedState *s)
+{
+    return qemu_clock_get_ns(s->clock);
+}
+
+int64_t rp2040_sched_now_ns(RP2040SchedState *s)
+{
+    return rp2040_sched_clock_ns(s) * s->time_dilation + s->offset_ns;
+}
+
+/*
+ * Earliest armed deadline that idle time may be skipped to, or INT64_MAX
+ * when there is none.  Watchdog events are rare, so when one is first in
+ * the heap the rest is simply searched.
+ */
+int64_t rp2040_sched_next_deadline(RP2040SchedState *s)
+{
+    int64_t next = INT64_MAX;
+    
+    if (s->heap_len && !s->heap[0]->watchdog) {
+        return s->heap[0]->deadline;
+    }
+    for (uint32_t i = 1; i < s->heap_len; i++) {
+        if (!s->heap[i]->watchdog && s->heap[i]->deadline < next) {
+            next = s->heap[i]->deadline;
+        }
+    }
+    
+    return next;
+}
+
+static void rp2040_sched_heap_set(RP2040SchedState *s, uint32_t i,
+                                  RP2040Event *ev)
+{
+    s->heap[i] = ev;
+    ev->heap_index = i;
+}
+
+static void rp2040_sched_sift_up(RP2040SchedState *s, uint32_t i)
+{
+    RP2040Event *ev = s->heap[i];
+    
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        
+        if (s->heap[parent]->deadline <= ev->deadline) {
+            break;
+        }
+        rp2040_sched_heap_set(s, i, s->heap[parent]);
+        i = parent;
+    }
+    rp2040_sched_heap_set(s, i, ev);
+}
+
+static void rp2040_sched_sift_down(RP2040SchedState *s, uint32_t i)
+{
+    RP2040Event *ev = s->heap[i];
+    
+    for (;;) {
+        uint32_t child = 2 * i + 1;
+        
+        if (child >= s->heap_len) {
+            break;
+        }
+        if (child + 1 < s->heap_len &&
+            s->heap[child + 1]->deadline < s->heap[child]->deadline) {
+            child++;
+        }
+        if (ev->deadline <= s->heap[child]->deadline) {
+            break;
+        }
+        rp2040_sched_heap_set(s, i, s->heap[child]);
+        i = child;
+    }
+    rp2040_sched_heap_set(s, i, ev);
+}
+
+static void rp2040_sched_heap_remove(RP2040SchedState *s, RP2040Event *ev)
+{
+    uint32_t i = ev->heap_index;
+    RP2040Event *last = s->heap[--s->heap_len];
+    
+    ev->heap_index = -1;
+    if (last == ev) {
+        return;
+    }
+    
+    rp2040_sched_heap_set(s, i, last);
+    if (i > 0 && s->heap[(i - 1) / 2]->deadline > last->deadline) {
+        rp2040_sched_sift_up(s, i);
+    } else {
+        rp2040_sched_sift_down(s, i);
+    }
+}
+
+/*
+ * Arm the host timer for the earliest deadline, if it changed.  On the
+ * realtime clock the timer would fire while the VM is stopped, so it is
+ * only armed while the VM runs.
+ */
+static void rp2040_sched_rearm(RP2040SchedState *s)
+{
+    int64_t host;
+    
+    if (s->dispatching || (s->realtime && !runstate_is_running())) {
+        return;
+    }
+    
+    if (!s->heap_len && !s->stall_ns) {
+        if (s->timer_deadline >= 0) {
+            timer_del(s->timer);
+            s->timer_deadline = -1;
+        }
+        return;
+    }
+    
+    if (s->stall_ns) {
+        /* Charge the stall as soon as the access that caused it is over */
+        host = rp2040_sched_clock_ns(s);
+    } else {
+        host = s->heap[0]->deadline - s->offset_ns;
+        host = host > 0 ? DIV_ROUND_UP(host, s->time_dilation) : 0;
+    }
+    if (host != s->timer_deadline) {
+        timer_mod(s->timer, host);
+        s->timer_deadline = host;
+    }
+}
+
+/* Run every event that is due, including ones armed by the callbacks */
+static void rp2040_sched_dispatch(RP2040SchedState *s)
+{
+    int64_t now;
+    
+    s->offset_ns += s->stall_ns;
+    s->stall_ns = 0;
+    now = rp2040_sched_now_ns(s);
+    
+    s->dispatching = true;
+    while (s->heap_len && s->heap[0]->deadline <= now) {
+        RP2040Event *ev = s->heap[0];
+        
+        rp2040_sched_heap_remove(s, ev);
+        ev->deadline = -1;
+        ev->cb(ev->opaque);
+    }
+    s->dispatching = false;
+    
+    rp2040_sched_rearm(s);
+}
+
+static void rp2040_sched_timer_cb(void *opaque)
+{
+    RP2040SchedState *s = opaque;
+    
+    s->timer_deadline = -1;
+    rp2040_sched_dispatch(s);
+}
+
+/*
+ * Skip ns of guest time, e.g. while the guest is idle.  Everything that
+ * becomes due runs before this returns.
+ */
+void rp2040_sched_advance(RP2040SchedState *s, int64_t ns)
+{
+    if (ns <= 0) {
+        return;
+    }
+    
+    s->offset_ns += ns;
+    rp2040_sched_dispatch(s);
+}
+
+/*
+ * Skip ns of guest time on behalf of the access being made, e.g. a flash
+ * fetch.  Dispatching events from inside an MMIO access or instruction
+ * fetch could run device callbacks under it, so the time is only added
+ * up here and charged from the scheduler timer, which is armed to fire
+ * right away.
+ */
+void rp2040_sched_stall(RP2040SchedState *s, int64_t ns)
+{
+    bool first = !s->stall_ns;
+    
+    s->stall_ns += ns;
+    if (first) {
+        rp2040_sched_rearm(s);
+    }
+}
+
+void rp2040_sched_note_write(RP2040SchedState *s, Object *dev,
+                             hwaddr offset, uint64_t value)
+{
+    RP2040WriteRecord *rec = &s->write_log[s->writes++ %
+                                           RP2040_SCHED_LOG_SIZE];
+    
+    rec->time_ns = rp2040_sched_now_ns(s);
+    rec->dev = dev;
+    rec->offset = offset;
+    rec->value = value;
+}
+
+/* Print the logged writes, oldest first */
+void rp2040_sched_dump_writes(RP2040SchedState *s)
+{
+    uint32_t n = MIN(s->writes, RP2040_SCHED_LOG_SIZE);
+    
+    error_printf("last %u of %" PRIu64 " device register writes:\n",
+                 n, s->writes);
+    for (uint64_t i = s->writes - n; i < s->writes; i++) {
+        RP2040WriteRecord *rec = &s->write_log[i % RP2040_SCHED_LOG_SIZE];
+        g_autofree char *name = object_get_canonical_path_component(rec->dev);
+        
+        error_printf("  %12.3f ms  %-10s +0x%03x <- 0x%08x\n",
+                     rec->time_ns / 1e6, name ? name : "?", rec->offset,
+                     rec->value);
+    }
+}
+
+/*
+ * Device state is reloaded on a rewind, but whatever a device keeps
+ * outside of it has to catch up; see rp2040-testctl.
+ */
+void rp2040_sched_add_rewind_notifier(RP2040SchedState *s, Notifier *n)
+{
+    notifier_list_add(&s->rewind_notifiers, n);
+}
+
+void rp2040_sched_notify_rewind(RP2040SchedState *s)
+{
+    notifier_list_notify(&s->rewind_notifiers, NULL);
+}
+
+void rp2040_event_init(RP2040Event *ev, RP2040SchedState *s,
+                       RP2040EventCB *cb, void *opaque)
+{
+    ev->sched = s;
+    ev->cb = cb;
+    ev->opaque = opaque;
+    ev->deadline = -1;
+    ev->heap_index = -1;
+    ev->watchdog = false;
+}
+
+void rp2040_event_init_watchdog(RP2040Event *ev, RP2040SchedState *s,
+                                RP2040EventCB *cb, void *opaque)
+{
+    rp2040_event_init(ev, s, cb, opaque);
+    ev->watchdog = true;
+}
+
+void rp2040_event_mod(RP2040Event *ev, int64_t deadline)
+{
+    RP2040SchedState *s = ev->sched;
+    
+    if (deadline < 0) {
+        deadline = 0;
+    }
+    
+    if (rp2040_event_pending(ev)) {
+        int64_t old = ev->deadline;
+        
+        ev->deadline = deadline;
+        if (deadline < old) {
+            rp2040_sched_sift_up(s, ev->heap_index);
+        } else {
+            rp2040_sched_sift_down(s, ev->heap_index);
+        }
+    } else {
+        if (s->heap_len == s->heap_size) {
+            s->heap_size = MAX(s->heap_size * 2, HEAP_INITIAL_SIZE);
+            s->heap = g_renew(RP2040Event *, s->heap, s->heap_size);
+        }
+        ev->deadline = deadline;
+        rp2040_sched_heap_set(s, s->heap_len++, ev);
+        rp2040_sched_sift_up(s, ev->heap_index);
+    }
+    
+    rp2040_sched_rearm(s);
+}
+
+void rp2040_event_del(RP2040Event *ev)
+{
+    if (!rp2040_event_pending(ev)) {
+        return;
+    }
+    
+    rp2040_sched_heap_remove(ev->sched, ev);
+    ev->deadline = -1;
+    rp2040_sched_rearm(ev->sched);
+}
+
+/*
+ * An event migrates as its deadline alone; the heap is rebuilt from the
+ * deadlines as they are loaded.
+ */
+static int rp2040_event_pre_load(void *opaque)
+{
+    RP2040Event *ev = opaque;
+    
+    rp2040_event_del(ev);
+    
+    return 0;
+}
+
+static int rp2040_event_post_load(void *opaque, int version_id)
+{
+    RP2040Event *ev = opaque;
+    int64_t deadline = ev->deadline;
+    
+    ev->deadline = -1;
+    if (deadline >= 0) {
+        rp2040_event_mod(ev, deadline);
+    }
+    
+    return 0;
+}
+
+const VMStateDescription vmstate_rp2040_event = {
+    .name = "rp2040-event",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_load = rp2040_event_pre_load,
+    .post_load = rp2040_event_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT64(deadline, RP2040Event),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/*
+ * Create and realize a private scheduler for a device that was not
+ * linked to the SoC one, e.g. when instantiated on its own.
+ */
+RP2040SchedState *rp2040_sched_create(Object *parent, bool realtime,
+                                      Error **errp)
+{
+    Object *obj = object_new(TYPE_RP2040_SCHED);
+    
+    object_property_add_child(parent, "sched", obj);
+    object_unref(obj);
+    qdev_prop_set_bit(DEVICE(obj), "realtime", realtime);
+    if (!qdev_realize(DEVICE(obj), NULL, errp)) {
+        object_unparent(obj);
+        return NULL;
+    }
+    
+    return RP2040_SCHED(obj);
+}
+
+/*
+ * Guest time keeps following the host clock while the VM is stopped, but
+ * deadlines that pass meanwhile are only acted on once it runs again.
+ */
+static void rp2040_sched_vm_state_change(void *opaque, bool running,
+                                         RunState state)
+{
+    RP2040SchedState *s = opaque;
+    
+    if (running) {
+        rp2040_sched_rearm(s);
+    } else if (s->timer_deadline >= 0) {
+        timer_del(s->timer);
+        s->timer_deadline = -1;
+    }
+}
+
+static void rp2040_sched_init(Object *obj)
+{
+    RP2040SchedState *s = RP2040_SCHED(obj);
+    
+    notifier_list_init(&s->rewind_notifiers);
+}
+
+static void rp2040_sched_realize(DeviceState *dev, Error **errp)
+{
+    RP2040SchedState *s = RP2040_SCHED(dev);
+    
+    if (s->time_dilation == 0) {
+        error_setg(errp, "rp2040-sched: time-dilation must be at least 1");
+        return;
+    }
+    
+    s->clock = s->realtime ? QEMU_CLOCK_REALTIME : QEMU_CLOCK_VIRTUAL;
+    s->timer = timer_new_ns(s->clock, rp2040_sched_timer_cb, s);
+    s->timer_deadline = -1;
+    if (s->realtime) {
+        s->vm_state_change = qemu_add_vm_change_state_handler(
+            rp2040_sched_vm_state_change, s);
+    }
+}
+
+static void rp2040_sched_unrealize(DeviceState *dev)
+{
+    RP2040SchedState *s = RP2040_SCHED(dev);
+    
+    if (s->vm_state_change) {
+        qemu_del_vm_change_state_handler(s->vm_state_change);
+        s->vm_state_change = NULL;
+    }
+    timer_free(s->timer);
+    s->timer = NULL;
+    g_free(s->heap);
+    s->heap = NULL;
+    s->heap_len = 0;
+    s->heap_size = 0;
+}
+
+static int rp2040_sched_post_load(void *opaque, int version_id)
+{
+    RP2040SchedState *s = opaque;
+    
+    /* The offset may have changed under the already loaded events */
+    s->timer_deadline = -1;
+    timer_del(s->timer);
+    rp2040_sched_rearm(s);
+    
+    return 0;
+}
+
+static bool rp2040_sched_stall_needed(void *opaque)
+{
+    RP2040SchedState *s = opaque;
+    
+    return s->stall_ns != 0;
+}
+
+static const VMStateDescription vmstate_rp2040_sched_stall = {
+    .name = TYPE_RP2040_SCHED "/stall",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = rp2040_sched_stall_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT64(stall_ns, RP2040SchedState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static int rp2040_sched_pre_load(void *opaque)
+{
+    RP2040SchedState *s = opaque;
+    
+    /* Only present in the stream when a stall was pending */
+    s->stall_ns = 0;
+    
+    return 0;
+}
+
+static const VMStateDescription vmstate_rp2040_sched = {
+    .name = TYPE_RP2040_SCHED,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_load = rp2040_sched_pre_load,
+    .post_load = rp2040_sched_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT64(offset_ns, RP2040SchedState),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * const []) {
+        &vmstate_rp2040_sched_stall,
+        NULL
+    }
+};
+
+static Property rp2040_sched_properties[] = {
+    DEFINE_PROP_UINT32("time-dilation", RP2040SchedState, time_dilation, 1),
+    DEFINE_PROP_BOOL("realtime", RP2040SchedState, realtime, false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void rp2040_sched_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    
+    dc->realize = rp2040_sched_realize;
+    dc->unrealize = rp2040_sched_unrealize;
+    dc->vmsd = &vmstate_rp2040_sched;
+    dc->user_creatable = false;
+    device_class_set_props(dc, rp2040_sched_properties);
+}
+
+static const TypeInfo rp2040_sched_info = {
+    .name          = TYPE_RP2040_SCHED,
+    .parent        = TYPE_DEVICE,
+    .instance_size = sizeof(RP2040SchedState),
+    .instance_init = rp2040_sched_init,
+    .class_init    = rp2040_sched_class_init,
+};
+
+static void rp2040_sched_register_types(void)
+{
+    type_register_static(&rp2040_sched_info);
+}
+
+type_init(rp2040_sched_register_types)
\ No newline at end of file
@@ -0,0 +1,202 @@
+/*
+ * RP2040 single-cycle I/O (SIO) block
+ *
+ * Only the bank 0 GPIO registers and CPUID are modelled: GPIO_OUT and
+ * GPIO_OE drive the output level and output enable of rp2040-gpio, which
+ * shows them in the pin STATUS registers and the VCD recording.  The
+ * inter-core FIFOs, spinlocks, dividers, interpolators and the QSPI GPIO
+ * registers read as zero and ignore writes, as before.
+ *
+ * Copyright (c) 2025 QEMU RP2040 Development Team
+ *
+ * This code is licensed under the GPL version 2 or later.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/misc/rp2040_sio.h"
+#include "hw/core/cpu.h"
+#include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
+#include "qapi/error.h"
+#include "qemu/log.h"
+
+/* Registers */
+#define SIO_CPUID           0x000
+#define SIO_GPIO_IN         0x004
+#define SIO_GPIO_OUT        0x010
+#define SIO_GPIO_OUT_SET    0x014
+#define SIO_GPIO_OUT_CLR    0x018
+#define SIO_GPIO_OUT_XOR    0x01C
+#define SIO_GPIO_OE         0x020
+#define SIO_GPIO_OE_SET     0x024
+#define SIO_GPIO_OE_CLR     0x028
+#define SIO_GPIO_OE_XOR     0x02C
+
+#define SIO_GPIO_MASK       ((1u << GPIO_NUM_PINS) - 1)
+
+static uint64_t rp2040_sio_read(void *opaque, hwaddr offset, unsigned size)
+{
+    RP2040SIOState *s = opaque;
+    
+    switch (offset) {
+    case SIO_CPUID:
+        return current_cpu ? current_cpu->cpu_index : 0;
+    case SIO_GPIO_IN:
+        return s->gpio->in_level;
+    case SIO_GPIO_OUT:
+    case SIO_GPIO_OUT_SET:
+    case SIO_GPIO_OUT_CLR:
+    case SIO_GPIO_OUT_XOR:
+        return s->gpio_out;
+    case SIO_GPIO_OE:
+    case SIO_GPIO_OE_SET:
+    case SIO_GPIO_OE_CLR:
+    case SIO_GPIO_OE_XOR:
+        return s->gpio_oe;
+    default:
+        qemu_log_mask(LOG_UNIMP,
+                      "rp2040_sio: unimplemented read offset 0x%"
+                      HWADDR_PRIx "\n", offset);
+        return 0;
+    }
+}
+
+static void rp2040_sio_write(void *opaque, hwaddr offset, uint64_t value,
+                             unsigned size)
+{
+    RP2040SIOState *s = opaque;
+    uint32_t val = value & SIO_GPIO_MASK;
+    
+    switch (offset) {
+    case SIO_GPIO_OUT:
+        s->gpio_out = val;
+        break;
+    case SIO_GPIO_OUT_SET:
+        s->gpio_out |= val;
+        break;
+    case SIO_GPIO_OUT_CLR:
+        s->gpio_out &= ~val;
+        break;
+    case SIO_GPIO_OUT_XOR:
+        s->gpio_out ^= val;
+        break;
+    case SIO_GPIO_OE:
+        s->gpio_oe = val;
+        break;
+    case SIO_GPIO_OE_SET:
+        s->gpio_oe |= val;
+        break;
+    case SIO_GPIO_OE_CLR:
+        s->gpio_oe &= ~val;
+        break;
+    case SIO_GPIO_OE_XOR:
+        s->gpio_oe ^= val;
+        break;
+    case SIO_CPUID:
+    case SIO_GPIO_IN:
+        /* Read only */
+        return;
+    default:
+        qemu_log_mask(LOG_UNIMP,
+                      "rp2040_sio: unimplemented write offset 0x%"
+                      HWADDR_PRIx "\n", offset);
+        return;
+    }
+    
+    /* GPIO activity is progress as far as the hang detector is concerned */
+    rp2040_sched_note_write(s->gpio->sched, OBJECT(s), offset, value);
+    rp2040_gpio_set_output_mask(s->gpio, SIO_GPIO_MASK, s->gpio_out);
+    rp2040_gpio_set_oe_mask(s->gpio, SIO_GPIO_MASK, s->gpio_oe);
+}
+
+static const MemoryRegionOps rp2040_sio_ops = {
+    .read = rp2040_sio_read,
+    .write = rp2040_sio_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 4,
+    },
+};
+
+static void rp2040_sio_init(Object *obj)
+{
+    RP2040SIOState *s = RP2040_SIO(obj);
+    
+    memory_region_init_io(&s->mmio, obj, &rp2040_sio_ops, s,
+                          TYPE_RP2040_SIO, 0x1000);
+    sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->mmio);
+}
+
+static void rp2040_sio_realize(DeviceState *dev, Error **errp)
+{
+    RP2040SIOState *s = RP2040_SIO(dev);
+    
+    if (!s->gpio) {
+        error_setg(errp, "rp2040-sio: 'gpio' link not set");
+        return;
+    }
+}
+
+/* rp2040-gpio resets its copy of the outputs itself */
+static void rp2040_sio_reset(DeviceState *dev)
+{
+    RP2040SIOState *s = RP2040_SIO(dev);
+    
+    s->gpio_out = 0;
+    s->gpio_oe = 0;
+}
+
+/* The outputs are only stored here, so hand the loaded ones to the pins */
+static int rp2040_sio_post_load(void *opaque, int version_id)
+{
+    RP2040SIOState *s = opaque;
+    
+    rp2040_gpio_set_output_mask(s->gpio, SIO_GPIO_MASK, s->gpio_out);
+    rp2040_gpio_set_oe_mask(s->gpio, SIO_GPIO_MASK, s->gpio_oe);
+    
+    return 0;
+}
+
+static const VMStateDescription vmstate_rp2040_sio = {
+    .name = TYPE_RP2040_SIO,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = rp2040_sio_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(gpio_out, RP2040SIOState),
+        VMSTATE_UINT32(gpio_oe, RP2040SIOState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property rp2040_sio_properties[] = {
+    DEFINE_PROP_LINK("gpio", RP2040SIOState, gpio, TYPE_RP2040_GPIO,
+                     RP2040GPIOState *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void rp2040_sio_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    
+    dc->realize = rp2040_sio_realize;
+    dc->reset = rp2040_sio_reset;
+    dc->vmsd = &vmstate_rp2040_sio;
+    device_class_set_props(dc, rp2040_sio_properties);
+}
+
+static const TypeInfo rp2040_sio_info = {
+    .name          = TYPE_RP2040_SIO,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(RP2040SIOState),
+    .instance_init = rp2040_sio_init,
+    .class_init    = rp2040_sio_class_init,
+};
+
+static void rp2040_sio_register_types(void)
+{
+    type_register_static(&rp2040_sio_info);
+}
+
+type_init(rp2040_sio_register_types)
\ No newline at end of file
@@ -0,0 +1,424 @@
+/*
+ * RP2040 test control device
+ *
+ * A QEMU-only block in an unused part of the APB space that lets test
+ * firmware boot once and then run many test cases from the same state.
+ * The guest writes CHECKPOINT once it is initialised and polls STATUS;
+ * SRAM and the state of every device are then saved in memory.  Each
+ * write of DONE rewinds the machine to that checkpoint and bumps RUN, so
+ * the firmware reads RUN to pick its next test case, until all "runs"
+ * have been made.  With "run-serial" set, UART0 gets a fresh chardev for
+ * every run.  Devices with state outside the guest (recordings, host-side
+ * checks) catch up through the scheduler's rewind notifiers.
+ *
+ * Writing EXIT ends QEMU at once with a pass or fail status, so test
+ * runners need neither a timeout nor to parse the output.
+ *
+ * Copyright (c) 2025 QEMU RP2040 Development Team
+ *
+ * This code is licensed under the GPL version 2 or later.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/misc/rp2040_testctl.h"
+#include "hw/qdev-properties.h"
+#include "chardev/char.h"
+#include "exec/exec-all.h"
+#include "io/channel-buffer.h"
+#include "migration/qemu-file.h"
+#include "migration/savevm.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "sysemu/runstate.h"
+
+/* Registers */
+#define TESTCTL_CTRL        0x00
+#define TESTCTL_STATUS      0x04
+#define TESTCTL_RUN         0x08
+#define TESTCTL_RUNS        0x0C
+#define TESTCTL_EXIT        0x10
+
+#define CTRL_CHECKPOINT     (1 << 0)
+#define CTRL_DONE           (1 << 1)
+
+#define STATUS_CHECKPOINTED (1 << 0)
+
+/* Give UART0 a new chardev from the run-serial template for this run */
+static void rp2040_testctl_switch_serial(RP2040TestCtlState *s)
+{
+    /* Labels must be unique for the life of the process, across resets */
+    static unsigned int chr_id;
+    g_autofree char *label = NULL;
+    g_autofree char *spec = NULL;
+    Error *err = NULL;
+    Chardev *chr;
+    
+    if (!s->run_serial || !s->uart[0]) {
+        return;
+    }
+    
+    label = g_strdup_printf("rp2040-run%u", chr_id++);
+    spec = g_strdup_printf(s->run_serial, s->run);
+    chr = qemu_chr_new(label, spec, NULL);
+    if (!chr) {
+        error_report("rp2040-testctl: cannot open run-serial '%s'", spec);
+        return;
+    }
+    
+    if (!s->run_chr) {
+        s->boot_chr = qemu_chr_fe_get_driver(&s->uart[0]->chr);
+    }
+    if (!rp2040_uart_set_chardev(s->uart[0], chr, &err)) {
+        error_report_err(err);
+        object_unparent(OBJECT(chr));
+        /* Stay on the chardev we had */
+        rp2040_uart_set_chardev(s->uart[0],
+                                s->run_chr ? s->run_chr : s->boot_chr, NULL);
+        return;
+    }
+    if (s->run_chr) {
+        object_unparent(OBJECT(s->run_chr));
+    }
+    s->run_chr = chr;
+}
+
+/* Get everything the guest has written out before a snapshot or exit */
+static void rp2040_testctl_flush_uarts(RP2040TestCtlState *s)
+{
+    for (int i = 0; i < ARRAY_SIZE(s->uart); i++) {
+        if (s->uart[i]) {
+            rp2040_uart_flush(s->uart[i]);
+        }
+    }
+}
+
+static void rp2040_testctl_checkpoint(RP2040TestCtlState *s)
+{
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(64 * 1024);
+    QEMUFile *f = qemu_file_new_output(QIO_CHANNEL(bioc));
+    int ret;
+    
+    /* Bytes still in flight belong to the boot, not to every run */
+    rp2040_testctl_flush_uarts(s);
+    
+    ret = qemu_save_device_state(f);
+    qemu_fflush(f);
+    if (ret < 0) {
+        error_report("rp2040-testctl: saving device state failed: %d", ret);
+        qemu_fclose(f);
+        object_unref(OBJECT(bioc));
+        return;
+    }
+    s->dev_state = g_memdup2(bioc->data, bioc->usage);
+    s->dev_state_len = bioc->usage;
+    qemu_fclose(f);
+    object_unref(OBJECT(bioc));
+    
+    for (int i = 0; i < RP2040_TESTCTL_NUM_RAM; i++) {
+        if (s->ram[i]) {
+            s->ram_copy[i] = g_memdup2(memory_region_get_ram_ptr(s->ram[i]),
+                                       memory_region_size(s->ram[i]));
+        }
+    }
+    
+    s->checkpointed = true;
+    s->run = 0;
+    rp2040_testctl_switch_serial(s);
+}
+
+static bool rp2040_testctl_rewind(RP2040TestCtlState *s)
+{
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(0);
+    QEMUFile *f;
+    int ret;
+    
+    for (int i = 0; i < RP2040_TESTCTL_NUM_RAM; i++) {
+        if (s->ram_copy[i]) {
+            uint64_t size = memory_region_size(s->ram[i]);
+            
+            memcpy(memory_region_get_ram_ptr(s->ram[i]), s->ram_copy[i],
+                   size);
+            memory_region_set_dirty(s->ram[i], 0, size);
+        }
+    }
+    /* Code in SRAM may have been translated from what the run left */
+    tb_flush(first_cpu);
+    
+    /* The stream starts with the file header that is not loaded here */
+    bioc->data = g_memdup2(s->dev_state, s->dev_state_len);
+    bioc->capacity = bioc->usage = s->dev_state_len;
+    f = qemu_file_new_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+    if (qemu_get_be32(f) != QEMU_VM_FILE_MAGIC ||
+        qemu_get_be32(f) != QEMU_VM_FILE_VERSION) {
+        error_report("rp2040-testctl: bad checkpoint stream");
+        qemu_fclose(f);
+        return false;
+    }
+    ret = qemu_load_device_state(f);
+    qemu_fclose(f);
+    if (ret < 0) {
+        return false;
+    }
+    
+    if (s->sched) {
+        rp2040_sched_notify_rewind(s->sched);
+    }
+    return true;
+}
+
+/*
+ * Snapshots and rewinds need the vCPUs stopped with their state synced,
+ * so the register writes only queue them for the main loop.
+ */
+static void rp2040_testctl_bh(void *opaque)
+{
+    RP2040TestCtlState *s = opaque;
+    bool running = runstate_is_running();
+    
+    vm_stop(RUN_STATE_PAUSED);
+    
+    if (s->checkpoint_pending) {
+        s->checkpoint_pending = false;
+        if (!s->checkpointed) {
+            rp2040_testctl_checkpoint(s);
+        }
+    }
+    
+    if (s->done_pending) {
+        s->done_pending = false;
+        if (!s->checkpointed || s->run + 1 >= s->runs) {
+            rp2040_testctl_flush_uarts(s);
+            qemu_system_shutdown_request(SHUTDOWN_CAUSE_GUEST_SHUTDOWN);
+            return;
+        }
+        s->run++;
+        rp2040_testctl_switch_serial(s);
+        if (!rp2040_testctl_rewind(s)) {
+            qemu_system_shutdown_request(SHUTDOWN_CAUSE_HOST_ERROR);
+            return;
+        }
+    }
+    
+    if (running) {
+        vm_start();
+    }
+}
+
+static void rp2040_testctl_exit(RP2040TestCtlState *s, uint32_t value)
+{
+    int code;
+    
+    switch (value & 0xffff) {
+    case RP2040_TESTCTL_EXIT_PASS:
+        code = 0;
+        break;
+    
+    case RP2040_TESTCTL_EXIT_FAIL:
+        /* The exit status is 8 bits; 256 must not read as a pass */
+        code = value >> 16 ? MIN(value >> 16, 255) : 1;
+        break;
+    
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+                     "rp2040_testctl: bad EXIT value 0x%08x\n", value);
+        return;
+    }
+    
+    rp2040_testctl_flush_uarts(s);
+    qemu_system_shutdown_request_with_code(SHUTDOWN_CAUSE_GUEST_SHUTDOWN,
+                                           code);
+}
+
+static uint64_t rp2040_testctl_read(void *opaque, hwaddr offset,
+                                    unsigned size)
+{
+    RP2040TestCtlState *s = opaque;
+    uint64_t val = 0;
+    
+    switch (offset) {
+    case TESTCTL_CTRL:
+        break;
+    
+    case TESTCTL_STATUS:
+        val = s->checkpointed ? STATUS_CHECKPOINTED : 0;
+        break;
+    
+    case TESTCTL_RUN:
+        val = s->run;
+        break;
+    
+    case TESTCTL_RUNS:
+        val = s->runs;
+        break;
+    
+    case TESTCTL_EXIT:
+        break;
+    
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+                     "rp2040_testctl: bad read offset 0x%" HWADDR_PRIx "\n",
+                     offset);
+    }
+    
+    return val;
+}
+
+static void rp2040_testctl_write(void *opaque, hwaddr offset,
+                                 uint64_t value, unsigned size)
+{
+    RP2040TestCtlState *s = opaque;
+    
+    switch (offset) {
+    case TESTCTL_CTRL:
+        if (value & CTRL_CHECKPOINT) {
+            s->checkpoint_pending = true;
+        }
+        if (value & CTRL_DONE) {
+            s->done_pending = true;
+        }
+        if (value & (CTRL_CHECKPOINT | CTRL_DONE)) {
+            qemu_bh_schedule(s->bh);
+        }
+        break;
+    
+    case TESTCTL_EXIT:
+        rp2040_testctl_exit(s, value);
+        break;
+    
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+                     "rp2040_testctl: bad write offset 0x%" HWADDR_PRIx "\n",
+                     offset);
+    }
+}
+
+static const MemoryRegionOps rp2040_testctl_ops = {
+    .read = rp2040_testctl_read,
+    .write = rp2040_testctl_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+};
+
+static void rp2040_testctl_init(Object *obj)
+{
+    RP2040TestCtlState *s = RP2040_TESTCTL(obj);
+    
+    memory_region_init_io(&s->mmio, obj, &rp2040_testctl_ops, s,
+                         TYPE_RP2040_TESTCTL, 0x1000);
+    sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->mmio);
+}
+
+/* A reset starts a different boot, so the old checkpoint is dropped */
+static void rp2040_testctl_reset(DeviceState *dev)
+{
+    RP2040TestCtlState *s = RP2040_TESTCTL(dev);
+    Error *err = NULL;
+    
+    /* The next boot writes to the UART's own chardev again */
+    if (s->run_chr) {
+        if (!rp2040_uart_set_chardev(s->uart[0], s->boot_chr, &err)) {
+            error_report_err(err);
+        }
+        object_unparent(OBJECT(s->run_chr));
+        s->run_chr = NULL;
+        s->boot_chr = NULL;
+    }
+    s->run = 0;
+    
+    s->checkpointed = false;
+    g_clear_pointer(&s->dev_state, g_free);
+    s->dev_state_len = 0;
+    for (int i = 0; i < RP2040_TESTCTL_NUM_RAM; i++) {
+        g_clear_pointer(&s->ram_copy[i], g_free);
+    }
+}
+
+/* The template is used as a format string: allow one %u and %% only */
+static bool rp2040_testctl_check_template(const char *spec)
+{
+    int conversions = 0;
+    
+    for (const char *p = strchr(spec, '%'); p; p = strchr(p + 2, '%')) {
+        if (p[1] == 'u') {
+            conversions++;
+        } else if (p[1] != '%') {
+            return false;
+        }
+    }
+    return conversions <= 1;
+}
+
+static void rp2040_testctl_realize(DeviceState *dev, Error **errp)
+{
+    RP2040TestCtlState *s = RP2040_TESTCTL(dev);
+    
+    if (s->runs == 0) {
+        error_setg(errp, "rp2040-testctl: runs must be at least 1");
+        return;
+    }
+    if (s->run_serial && !rp2040_testctl_check_template(s->run_serial)) {
+        error_setg(errp, "rp2040-testctl: run-serial may only contain "
+                   "one %%u for the run index");
+        return;
+    }
+    
+    s->bh = qemu_bh_new(rp2040_testctl_bh, s);
+}
+
+static void rp2040_testctl_unrealize(DeviceState *dev)
+{
+    RP2040TestCtlState *s = RP2040_TESTCTL(dev);
+    
+    qemu_bh_delete(s->bh);
+    g_free(s->dev_state);
+    for (int i = 0; i < RP2040_TESTCTL_NUM_RAM; i++) {
+        g_free(s->ram_copy[i]);
+    }
+}
+
+/*
+ * There is deliberately no vmstate: the run index and the checkpoint
+ * must survive the rewinds that reload everything else.
+ */
+static Property rp2040_testctl_properties[] = {
+    DEFINE_PROP_LINK("sram", RP2040TestCtlState, ram[0],
+                     TYPE_MEMORY_REGION, MemoryRegion *),
+    DEFINE_PROP_LINK("xip-sram", RP2040TestCtlState, ram[1],
+                     TYPE_MEMORY_REGION, MemoryRegion *),
+    DEFINE_PROP_LINK("uart0", RP2040TestCtlState, uart[0], TYPE_RP2040_UART,
+                     RP2040UARTState *),
+    DEFINE_PROP_LINK("uart1", RP2040TestCtlState, uart[1], TYPE_RP2040_UART,
+                     RP2040UARTState *),
+    DEFINE_PROP_LINK("scheduler", RP2040TestCtlState, sched,
+                     TYPE_RP2040_SCHED, RP2040SchedState *),
+    DEFINE_PROP_UINT32("runs", RP2040TestCtlState, runs, 1),
+    DEFINE_PROP_STRING("run-serial", RP2040TestCtlState, run_serial),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void rp2040_testctl_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    
+    dc->realize = rp2040_testctl_realize;
+    dc->unrealize = rp2040_testctl_unrealize;
+    dc->reset = rp2040_testctl_reset;
+    device_class_set_props(dc, rp2040_testctl_properties);
+}
+
+static const TypeInfo rp2040_testctl_info = {
+    .name          = TYPE_RP2040_TESTCTL,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(RP2040TestCtlState),
+    .instance_init = rp2040_testctl_init,
+    .class_init    = rp2040_testctl_class_init,
+};
+
+static void rp2040_testctl_register_types(void)
+{
+    type_register_static(&rp2040_testctl_info);
+}
+
+type_init(rp2040_testctl_register_types)
\ No newline at end of file
@@ -0,0 +1,429 @@
+/*
+ * RP2040 XIP cache and control registers
+ *
+ * The cores reach the QSPI flash through a 16 KB, 2-way set-associative
+ * cache with 8-byte lines, at four aliases that differ in how they use
+ * the cache.  Without the cache model each alias maps the flash straight
+ * in and only the XIP_CTRL registers exist.  With it, every access to
+ * the window goes through this device so that hits and misses can be
+ * counted and each miss charged a flash latency in guest time.  That
+ * makes code running from flash much slower to emulate, so the model is
+ * meant for profiling runs.
+ *
+ * While the cache is disabled its data RAM is usable as 16 KB of SRAM.
+ *
+ * Copyright (c) 2025 QEMU RP2040 Development Team
+ *
+ * This code is licensed under the GPL version 2 or later.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/misc/rp2040_xip.h"
+#include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/log.h"
+
+/* XIP_CTRL registers */
+#define XIP_CTRL            0x00
+#define XIP_FLUSH           0x04
+#define XIP_STAT            0x08
+#define XIP_CTR_HIT         0x0C
+#define XIP_CTR_ACC         0x10
+#define XIP_STREAM_ADDR     0x14
+#define XIP_STREAM_CTR      0x18
+#define XIP_STREAM_FIFO     0x1C
+
+#define CTRL_EN             (1 << 0)
+#define CTRL_ERR_BADWRITE   (1 << 1)
+#define CTRL_POWER_DOWN     (1 << 3)
+#define CTRL_MASK           (CTRL_EN | CTRL_ERR_BADWRITE | CTRL_POWER_DOWN)
+
+#define STAT_FLUSH_READY    (1 << 0)
+#define STAT_FIFO_EMPTY     (1 << 1)
+
+#define STREAM_ADDR_MASK    0xFFFFFFFC
+#define STREAM_CTR_MASK     0x3FFFFF
+
+/*
+ * One 8-byte line over quad SPI at clk_sys/2: command, address, dummy and
+ * data clocks come to about 60 cycles of a 125 MHz clk_sys.
+ */
+#define MISS_LATENCY_DEFAULT_NS 480
+
+/* Offset of an XIP address in the flash */
+#define FLASH_OFFSET_MASK   0xFFFFFF
+
+/* Look up the line holding flash offset addr and return true on a hit */
+static bool rp2040_xip_cache_lookup(RP2040XIPState *s, hwaddr addr)
+{
+    uint32_t line = addr / RP2040_XIP_CACHE_LINE;
+    uint32_t set = line % RP2040_XIP_CACHE_SETS;
+    uint32_t tag = ((line / RP2040_XIP_CACHE_SETS) << 1) | 1;
+    
+    for (int way = 0; way < RP2040_XIP_CACHE_WAYS; way++) {
+        if (s->tags[set][way] == tag) {
+            s->victim[set] = (way + 1) % RP2040_XIP_CACHE_WAYS;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+/* Bring a line in, replacing the least recently used way of its set */
+static void rp2040_xip_cache_fill(RP2040XIPState *s, hwaddr addr)
+{
+    uint32_t line = addr / RP2040_XIP_CACHE_LINE;
+    uint32_t set = line % RP2040_XIP_CACHE_SETS;
+    uint32_t tag = ((line / RP2040_XIP_CACHE_SETS) << 1) | 1;
+    int way = s->victim[set];
+    
+    s->tags[set][way] = tag;
+    s->victim[set] = (way + 1) % RP2040_XIP_CACHE_WAYS;
+}
+
+static void rp2040_xip_cache_flush(RP2040XIPState *s)
+{
+    memset(s->tags, 0, sizeof(s->tags));
+    memset(s->victim, 0, sizeof(s->victim));
+}
+
+static bool rp2040_xip_mode_checks(RP2040XIPMode mode)
+{
+    return mode == RP2040_XIP_MODE_CACHED || mode == RP2040_XIP_MODE_NOALLOC;
+}
+
+static bool rp2040_xip_mode_allocates(RP2040XIPMode mode)
+{
+    return mode == RP2040_XIP_MODE_CACHED || mode == RP2040_XIP_MODE_NOCACHE;
+}
+
+/*
+ * Account one access through the cache.  Anything that does not hit
+ * waits for the flash, but only accesses that looked the line up count
+ * as misses.
+ */
+static void rp2040_xip_access(RP2040XIPState *s, RP2040XIPMode mode,
+                              hwaddr addr)
+{
+    if (s->ctrl & CTRL_EN) {
+        if (rp2040_xip_mode_checks(mode)) {
+            s->ctr_acc++;
+            if (rp2040_xip_cache_lookup(s, addr)) {
+                s->ctr_hit++;
+                s->stat_hits++;
+                return;
+            }
+            s->stat_misses++;
+        }
+        if (rp2040_xip_mode_allocates(mode)) {
+            rp2040_xip_cache_fill(s, addr);
+        }
+    }
+    
+    rp2040_sched_stall(s->sched, s->miss_latency_ns);
+}
+
+static uint64_t rp2040_xip_flash_read(void *opaque, hwaddr addr,
+                                      unsigned size)
+{
+    RP2040XIPView *view = opaque;
+    RP2040XIPState *s = view->xip;
+    uint8_t *flash = memory_region_get_ram_ptr(s->flash);
+    
+    rp2040_xip_access(s, view->mode, addr);
+    
+    return ldn_le_p(flash + addr, size);
+}
+
+/*
+ * Stores still reach the flash contents, as they do without the model;
+ * an allocating alias brings the line in but the access is not counted.
+ */
+static void rp2040_xip_flash_write(void *opaque, hwaddr addr,
+                                   uint64_t value, unsigned size)
+{
+    RP2040XIPView *view = opaque;
+    RP2040XIPState *s = view->xip;
+    uint8_t *flash = memory_region_get_ram_ptr(s->flash);
+    
+    if ((s->ctrl & CTRL_EN) && rp2040_xip_mode_allocates(view->mode) &&
+        !rp2040_xip_cache_lookup(s, addr)) {
+        rp2040_xip_cache_fill(s, addr);
+    }
+    
+    stn_le_p(flash + addr, size, value);
+    memory_region_set_dirty(s->flash, addr, size);
+}
+
+/* The cache data RAM appears at XIP_SRAM only while the cache is off */
+static void rp2040_xip_update_sram(RP2040XIPState *s)
+{
+    memory_region_set_enabled(&s->sram, !(s->ctrl & CTRL_EN));
+}
+
+static const MemoryRegionOps rp2040_xip_flash_ops = {
+    .read = rp2040_xip_flash_read,
+    .write = rp2040_xip_flash_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .valid = {
+        .min_access_size = 1,
+        .max_access_size = 4,
+    },
+    .impl = {
+        .min_access_size = 1,
+        .max_access_size = 4,
+    },
+};
+
+static uint64_t rp2040_xip_ctrl_read(void *opaque, hwaddr offset,
+                                     unsigned size)
+{
+    RP2040XIPState *s = opaque;
+    uint64_t val = 0;
+    
+    switch (offset) {
+    case XIP_CTRL:
+        val = s->ctrl;
+        break;
+    
+    case XIP_FLUSH:
+        /* Flushes complete immediately */
+        break;
+    
+    case XIP_STAT:
+        val = STAT_FLUSH_READY | STAT_FIFO_EMPTY;
+        break;
+    
+    case XIP_CTR_HIT:
+        val = s->ctr_hit;
+        break;
+    
+    case XIP_CTR_ACC:
+        val = s->ctr_acc;
+        break;
+    
+    case XIP_STREAM_ADDR:
+        val = s->stream_addr;
+        break;
+    
+    case XIP_STREAM_CTR:
+        val = s->stream_ctr;
+        break;
+    
+    case XIP_STREAM_FIFO: {
+        /* The stream has no FIFO depth here; each pop reads the flash */
+        uint32_t addr = s->stream_addr & FLASH_OFFSET_MASK;
+        
+        if (s->stream_ctr &&
+            addr + 4 <= memory_region_size(s->flash)) {
+            val = ldl_le_p((uint8_t *)memory_region_get_ram_ptr(s->flash) +
+                           addr);
+            s->stream_addr += 4;
+            s->stream_ctr--;
+        }
+        break;
+    }
+    
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+                     "rp2040_xip: bad read offset 0x%" HWADDR_PRIx "\n",
+                     offset);
+    }
+    
+    return val;
+}
+
+static void rp2040_xip_ctrl_write(void *opaque, hwaddr offset,
+                                  uint64_t value, unsigned size)
+{
+    RP2040XIPState *s = opaque;
+    
+    rp2040_sched_note_write(s->sched, OBJECT(s), offset, value);
+    
+    switch (offset) {
+    case XIP_CTRL:
+        s->ctrl = value & CTRL_MASK;
+        rp2040_xip_update_sram(s);
+        break;
+    
+    case XIP_FLUSH:
+        if (value & 1) {
+            rp2040_xip_cache_flush(s);
+        }
+        break;
+    
+    case XIP_CTR_HIT:
+        /* Any write clears the counter */
+        s->ctr_hit = 0;
+        break;
+    
+    case XIP_CTR_ACC:
+        s->ctr_acc = 0;
+        break;
+    
+    case XIP_STREAM_ADDR:
+        s->stream_addr = value & STREAM_ADDR_MASK;
+        break;
+    
+    case XIP_STREAM_CTR:
+        s->stream_ctr = value & STREAM_CTR_MASK;
+        break;
+    
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+                     "rp2040_xip: bad write offset 0x%" HWADDR_PRIx "\n",
+                     offset);
+    }
+}
+
+static const MemoryRegionOps rp2040_xip_ctrl_ops = {
+    .read = rp2040_xip_ctrl_read,
+    .write = rp2040_xip_ctrl_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+};
+
+static void rp2040_xip_reset(DeviceState *dev)
+{
+    RP2040XIPState *s = RP2040_XIP(dev);
+    
+    s->ctrl = CTRL_EN | CTRL_ERR_BADWRITE;
+    s->ctr_hit = 0;
+    s->ctr_acc = 0;
+    s->stream_addr = 0;
+    s->stream_ctr = 0;
+    rp2040_xip_cache_flush(s);
+    rp2040_xip_update_sram(s);
+}
+
+static void rp2040_xip_init(Object *obj)
+{
+    RP2040XIPState *s = RP2040_XIP(obj);
+    
+    memory_region_init_io(&s->ctrl_mmio, obj, &rp2040_xip_ctrl_ops, s,
+                         TYPE_RP2040_XIP, 0x1000);
+    sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->ctrl_mmio);
+    
+    object_property_add_uint64_ptr(obj, "hits", &s->stat_hits,
+                                   OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "misses", &s->stat_misses,
+                                   OBJ_PROP_FLAG_READ);
+}
+
+static void rp2040_xip_realize(DeviceState *dev, Error **errp)
+{
+    static const char *const view_names[RP2040_XIP_NUM_MODES] = {
+        [RP2040_XIP_MODE_CACHED] = "rp2040.xip-cached",
+        [RP2040_XIP_MODE_NOALLOC] = "rp2040.xip-noalloc",
+        [RP2040_XIP_MODE_NOCACHE] = "rp2040.xip-nocache",
+        [RP2040_XIP_MODE_NOCACHE_NOALLOC] = "rp2040.xip-nocache-noalloc",
+    };
+    RP2040XIPState *s = RP2040_XIP(dev);
+    uint64_t size;
+    
+    if (!s->flash) {
+        error_setg(errp, "rp2040-xip: 'flash' link not set");
+        return;
+    }
+    size = memory_region_size(s->flash);
+    
+    if (!s->sched) {
+        s->sched = rp2040_sched_create(OBJECT(dev), false, errp);
+        if (!s->sched) {
+            return;
+        }
+    }
+    
+    /*
+     * Without the cache model the aliases are plain aliases of the flash,
+     * so they cost nothing and share its backing.
+     */
+    for (int i = 0; i < RP2040_XIP_NUM_MODES; i++) {
+        RP2040XIPView *view = &s->view[i];
+        
+        view->xip = s;
+        view->mode = i;
+        if (s->cache_model) {
+            memory_region_init_io(&view->mr, OBJECT(dev),
+                                  &rp2040_xip_flash_ops, view,
+                                  view_names[i], size);
+        } else {
+            memory_region_init_alias(&view->mr, OBJECT(dev), view_names[i],
+                                     s->flash, 0, size);
+        }
+        sysbus_init_mmio(SYS_BUS_DEVICE(dev), &view->mr);
+    }
+    
+    if (!memory_region_init_ram(&s->sram, OBJECT(dev), "rp2040.xip-sram",
+                                RP2040_XIP_CACHE_SIZE, errp)) {
+        return;
+    }
+    sysbus_init_mmio(SYS_BUS_DEVICE(dev), &s->sram);
+}
+
+static int rp2040_xip_post_load(void *opaque, int version_id)
+{
+    RP2040XIPState *s = opaque;
+    
+    rp2040_xip_update_sram(s);
+    
+    return 0;
+}
+
+static const VMStateDescription vmstate_rp2040_xip = {
+    .name = TYPE_RP2040_XIP,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = rp2040_xip_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ctrl, RP2040XIPState),
+        VMSTATE_UINT32(ctr_hit, RP2040XIPState),
+        VMSTATE_UINT32(ctr_acc, RP2040XIPState),
+        VMSTATE_UINT32(stream_addr, RP2040XIPState),
+        VMSTATE_UINT32(stream_ctr, RP2040XIPState),
+        VMSTATE_UINT32_2DARRAY(tags, RP2040XIPState,
+                               RP2040_XIP_CACHE_SETS, RP2040_XIP_CACHE_WAYS),
+        VMSTATE_UINT8_ARRAY(victim, RP2040XIPState, RP2040_XIP_CACHE_SETS),
+        VMSTATE_UINT64(stat_hits, RP2040XIPState),
+        VMSTATE_UINT64(stat_misses, RP2040XIPState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property rp2040_xip_properties[] = {
+    DEFINE_PROP_LINK("flash", RP2040XIPState, flash, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_LINK("scheduler", RP2040XIPState, sched, TYPE_RP2040_SCHED,
+                     RP2040SchedState *),
+    DEFINE_PROP_BOOL("cache-model", RP2040XIPState, cache_model, false),
+    DEFINE_PROP_UINT32("miss-latency-ns", RP2040XIPState, miss_latency_ns,
+                       MISS_LATENCY_DEFAULT_NS),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void rp2040_xip_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    
+    dc->realize = rp2040_xip_realize;
+    dc->reset = rp2040_xip_reset;
+    dc->vmsd = &vmstate_rp2040_xip;
+    device_class_set_props(dc, rp2040_xip_properties);
+}
+
+static const TypeInfo rp2040_xip_info = {
+    .name          = TYPE_RP2040_XIP,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(RP2040XIPState),
+    .instance_init = rp2040_xip_init,
+    .class_init    = rp2040_xip_class_init,
+};
+
+static void rp2040_xip_register_types(void)
+{
+    type_register_static(&rp2040_xip_info);
+}
+
+type_init(rp2040_xip_register_types)
\ No newline at end of file
@@ -8,11 +8,16 @@
 
 #include "qemu/osdep.h"
 #include "hw/timer/rp2040_timer.h"
+#include "hw/core/cpu.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "migration/vmstate.h"
+#include "qapi/error.h"
+#include "qemu/config-file.h"
 #include "qemu/log.h"
+#include "qemu/option.h"
 #include "qemu/timer.h"
+#include "sysemu/cpu-timers.h"
 #include "trace.h"
 
 /* Timer registers */
@@ -34,18 +39,45 @@
 #define INTF            0x3C
 #define INTS            0x40
 
+/*
+ * Poll-loop fast-forward: this many counter reads in a row, each within
+ * POLL_GAP_NS of the previous one and with no register write in between,
+ * are taken as the guest spinning on the counter.
+ */
+#define POLL_THRESHOLD      64
+#define POLL_GAP_NS         2000
+#define POLL_STEP_MAX_US    1000
+
+/* Guest time in us, as kept by the SoC scheduler */
+static uint64_t rp2040_timer_now_us(RP2040TimerState *s)
+{
+    return rp2040_sched_now_ns(s->sched) / SCALE_US;
+}
+
 static uint64_t rp2040_timer_get_count(RP2040TimerState *s)
 {
-    return qemu_clock_get_us(QEMU_CLOCK_VIRTUAL) - s->time_base;
+    return rp2040_timer_now_us(s) - s->time_base;
+}
+
+static uint64_t rp2040_timer_alarm_time(RP2040TimerState *s, int alarm)
+{
+    return ((uint64_t)s->alarm_high[alarm] << 32) | s->alarm[alarm];
+}
+
+static void rp2040_timer_update_irq(RP2040TimerState *s)
+{
+    for (int i = 0; i < 4; i++) {
+        qemu_set_irq(s->irq[i], (s->intr & s->inte) & (1 << i));
+    }
 }
 
 static void rp2040_timer_update_alarm(RP2040TimerState *s, int alarm)
 {
     uint64_t now = rp2040_timer_get_count(s);
-    uint64_t alarm_time = ((uint64_t)s->alarm_high[alarm] << 32) | s->alarm[alarm];
+    uint64_t alarm_time = rp2040_timer_alarm_time(s, alarm);
     
     if (!(s->armed & (1 << alarm))) {
-        timer_del(s->alarm_timer[alarm]);
+        rp2040_event_del(&s->alarm_timer[alarm]);
         return;
     }
     
@@ -53,25 +85,81 @@ static void rp2040_timer_update_alarm(RP2040TimerState *s, int alarm)
         /* Alarm should fire immediately */
         s->intr |= (1 << alarm);
         s->armed &= ~(1 << alarm);
-        timer_del(s->alarm_timer[alarm]);
+        rp2040_event_del(&s->alarm_timer[alarm]);
+        rp2040_timer_update_irq(s);
     } else {
         /* Schedule alarm */
-        timer_mod(s->alarm_timer[alarm], 
-                 qemu_clock_get_us(QEMU_CLOCK_VIRTUAL) + (alarm_time - now));
+        rp2040_event_mod(&s->alarm_timer[alarm],
+                         (s->time_base + alarm_time) * SCALE_US);
     }
 }
 
+/* Shared by all four alarm events: fire every armed alarm that is due */
 static void rp2040_timer_alarm_cb(void *opaque)
 {
     RP2040TimerState *s = opaque;
-    int alarm = (intptr_t)opaque - (intptr_t)s;
-    alarm = alarm / sizeof(s->alarm_timer[0]);
+    uint64_t now = rp2040_timer_get_count(s);
     
-    s->intr |= (1 << alarm);
-    s->armed &= ~(1 << alarm);
+    for (int i = 0; i < 4; i++) {
+        if ((s->armed & (1 << i)) && rp2040_timer_alarm_time(s, i) <= now) {
+            s->intr |= (1 << i);
+            s->armed &= ~(1 << i);
+        }
+    }
+    rp2040_timer_update_irq(s);
+}
+
+/*
+ * Advance guest time past a polling loop.  The guest may be waiting for
+ * a counter value we do not know, so step forward by an eighth of the
+ * time it has already spent polling, at most POLL_STEP_MAX_US: a
+ * busy_wait_us() then ends no more than an eighth late, and a short one
+ * by a few us rather than up to 1 ms.  A step never goes past the
+ * earliest event armed in the scheduler (an alarm, a UART character, a
+ * stimulus edge), which then fires.  Watchdog events such as test
+ * deadlines do not stop a step.
+ *
+ * Time moves for the whole SoC, so this is only done while every other
+ * core sleeps; a core that is still running would see time jump under
+ * it, and its own progress moves time along anyway.
+ */
+static void rp2040_timer_fast_forward(RP2040TimerState *s)
+{
+    int64_t now = rp2040_sched_now_ns(s->sched);
+    int64_t target = rp2040_sched_next_deadline(s->sched);
+    int64_t step = MIN(MAX((now - s->poll_start_ns) / 8, SCALE_US),
+                       POLL_STEP_MAX_US * SCALE_US);
+    CPUState *cpu;
     
-    if (s->inte & (1 << alarm)) {
-        qemu_set_irq(s->irq[alarm], 1);
+    CPU_FOREACH(cpu) {
+        if (cpu != current_cpu && !cpu->halted) {
+            return;
+        }
+    }
+    
+    rp2040_sched_advance(s->sched, MIN(target - now, step));
+}
+
+/* Called on every counter read to detect tight polling loops */
+static void rp2040_timer_poll(RP2040TimerState *s)
+{
+    int64_t now_ns;
+    
+    if (!s->poll_ff) {
+        return;
+    }
+    
+    now_ns = rp2040_sched_clock_ns(s->sched);
+    if (now_ns - s->poll_last_ns > POLL_GAP_NS) {
+        s->poll_count = 0;
+    }
+    if (s->poll_count == 0) {
+        s->poll_start_ns = rp2040_sched_now_ns(s->sched);
+    }
+    s->poll_last_ns = now_ns;
+    
+    if (++s->poll_count >= POLL_THRESHOLD) {
+        rp2040_timer_fast_forward(s);
     }
 }
 
@@ -83,6 +171,7 @@ static uint64_t rp2040_timer_read(void *opaque, hwaddr offset, unsigned size)
     
     switch (offset) {
     case TIMEHW:
+        rp2040_timer_poll(s);
         count = rp2040_timer_get_count(s);
         s->latched_count = count;
         val = count >> 32;
@@ -93,11 +182,13 @@ static uint64_t rp2040_timer_read(void *opaque, hwaddr offset, unsigned size)
         break;
         
     case TIMEHR:
+        rp2040_timer_poll(s);
         count = rp2040_timer_get_count(s);
         val = count >> 32;
         break;
         
     case TIMELR:
+        rp2040_timer_poll(s);
         count = rp2040_timer_get_count(s);
         val = count & 0xFFFFFFFF;
         break;
@@ -120,11 +211,13 @@ static uint64_t rp2040_timer_read(void *opaque, hwaddr offset, unsigned size)
         break;
         
     case TIMERAWH:
+        rp2040_timer_poll(s);
         count = rp2040_timer_get_count(s);
         val = count >> 32;
         break;
         
     case TIMERAWL:
+        rp2040_timer_poll(s);
         count = rp2040_timer_get_count(s);
         val = count & 0xFFFFFFFF;
         break;
@@ -167,10 +260,14 @@ static void rp2040_timer_write(void *opaque, hwaddr offset,
 {
     RP2040TimerState *s = opaque;
     
+    /* Any write means the guest is doing more than spinning */
+    s->poll_count = 0;
+    rp2040_sched_note_write(s->sched, OBJECT(s), offset, value);
+    
     switch (offset) {
     case TIMELW:
         /* Write to lower 32 bits of timer - sets new base */
-        s->time_base = qemu_clock_get_us(QEMU_CLOCK_VIRTUAL) - value;
+        s->time_base = rp2040_timer_now_us(s) - value;
         /* Update alarms with new time base */
         for (int i = 0; i < 4; i++) {
             rp2040_timer_update_alarm(s, i);
@@ -207,7 +304,7 @@ static void rp2040_timer_write(void *opaque, hwaddr offset,
         s->armed &= ~value;
         for (int i = 0; i < 4; i++) {
             if (value & (1 << i)) {
-                timer_del(s->alarm_timer[i]);
+                rp2040_event_del(&s->alarm_timer[i]);
             }
         }
         break;
@@ -223,15 +320,12 @@ static void rp2040_timer_write(void *opaque, hwaddr offset,
     case INTR:
         /* Clear interrupt bits by writing 1 */
         s->intr &= ~value;
-        for (int i = 0; i < 4; i++) {
-            if (value & (1 << i)) {
-                qemu_set_irq(s->irq[i], 0);
-            }
-        }
+        rp2040_timer_update_irq(s);
         break;
         
     case INTE:
         s->inte = value & 0xF;
+        rp2040_timer_update_irq(s);
         break;
         
     case INTF:
@@ -255,7 +349,7 @@ static void rp2040_timer_reset(DeviceState *dev)
 {
     RP2040TimerState *s = RP2040_TIMER(dev);
     
-    s->time_base = qemu_clock_get_us(QEMU_CLOCK_VIRTUAL);
+    s->time_base = rp2040_timer_now_us(s);
     s->latched_count = 0;
     s->armed = 0;
     s->dbgpause = 0;
@@ -263,11 +357,12 @@ static void rp2040_timer_reset(DeviceState *dev)
     s->intr = 0;
     s->inte = 0;
     s->intf = 0;
+    s->poll_count = 0;
     
     for (int i = 0; i < 4; i++) {
         s->alarm[i] = 0;
         s->alarm_high[i] = 0;
-        timer_del(s->alarm_timer[i]);
+        rp2040_event_del(&s->alarm_timer[i]);
     }
 }
 
@@ -286,22 +381,109 @@ static void rp2040_timer_init(Object *obj)
     }
 }
 
+/*
+ * Whether -icount leaves sleep on, in which case QEMU waits out idle
+ * time in real time instead of moving the virtual clock to the next
+ * deadline
+ */
+static bool rp2040_timer_icount_sleeps(void)
+{
+    QemuOpts *opts = qemu_opts_find(qemu_find_opts("icount"), NULL);
+    
+    return !opts || qemu_opt_get_bool(opts, "sleep", true);
+}
+
 static void rp2040_timer_realize(DeviceState *dev, Error **errp)
 {
     RP2040TimerState *s = RP2040_TIMER(dev);
+    bool realtime;
     
-    /* Create timers for alarms */
+    if (!s->time_mode_str) {
+        /* Follow the clock of the scheduler we are linked to */
+        s->time_mode = s->sched && s->sched->realtime ?
+                       RP2040_TIMER_TIME_REALTIME : RP2040_TIMER_TIME_VIRTUAL;
+    } else if (!strcmp(s->time_mode_str, "virtual")) {
+        s->time_mode = RP2040_TIMER_TIME_VIRTUAL;
+    } else if (!strcmp(s->time_mode_str, "icount")) {
+        s->time_mode = RP2040_TIMER_TIME_ICOUNT;
+    } else if (!strcmp(s->time_mode_str, "realtime")) {
+        s->time_mode = RP2040_TIMER_TIME_REALTIME;
+    } else if (!strcmp(s->time_mode_str, "warp")) {
+        s->time_mode = RP2040_TIMER_TIME_WARP;
+    } else {
+        error_setg(errp, "rp2040-timer: invalid time-mode '%s' (expected "
+                   "'virtual', 'icount', 'realtime' or 'warp')",
+                   s->time_mode_str);
+        return;
+    }
+    
+    switch (s->time_mode) {
+    case RP2040_TIMER_TIME_ICOUNT:
+    case RP2040_TIMER_TIME_WARP:
+        /*
+         * With -icount the virtual clock advances with executed
+         * instructions only, so the counter is reproducible.  With
+         * sleep=off QEMU also moves the virtual clock straight to the next
+         * timer deadline once every core has stopped in WFI; warp adds
+         * poll fast-forward for cores that spin in WFE/time_reached()
+         * loops instead of halting.
+         */
+        if (!icount_enabled()) {
+            error_setg(errp, "rp2040-timer: time-mode '%s' requires -icount",
+                       s->time_mode_str);
+            return;
+        }
+        if (s->time_mode == RP2040_TIMER_TIME_WARP &&
+            s->poll_ff_mode == ON_OFF_AUTO_OFF) {
+            error_setg(errp, "rp2040-timer: time-mode 'warp' needs "
+                       "poll-fast-forward, which is set to off");
+            return;
+        }
+        if (s->time_mode == RP2040_TIMER_TIME_WARP &&
+            rp2040_timer_icount_sleeps()) {
+            error_setg(errp, "rp2040-timer: time-mode 'warp' requires "
+                       "-icount sleep=off");
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+    
+    /* auto: only warp fast-forwards polling loops */
+    s->poll_ff = s->poll_ff_mode == ON_OFF_AUTO_ON ||
+                 (s->poll_ff_mode == ON_OFF_AUTO_AUTO &&
+                  s->time_mode == RP2040_TIMER_TIME_WARP);
+    
+    /*
+     * The counter is guest time as kept by the scheduler, so realtime
+     * mode needs a scheduler running on the host clock.  In the SoC that
+     * is its realtime property; on our own we create one.
+     */
+    realtime = s->time_mode == RP2040_TIMER_TIME_REALTIME;
+    if (!s->sched) {
+        s->sched = rp2040_sched_create(OBJECT(dev), realtime, errp);
+        if (!s->sched) {
+            return;
+        }
+    } else if (s->sched->realtime != realtime) {
+        error_setg(errp, "rp2040-timer: time-mode '%s' does not match the "
+                   "scheduler clock; in the SoC, select the host clock with "
+                   "-machine raspberrypi-pico,realtime=on", s->time_mode_str);
+        return;
+    }
+    
+    /* Create events for alarms */
     for (int i = 0; i < 4; i++) {
-        s->alarm_timer[i] = timer_new_us(QEMU_CLOCK_VIRTUAL,
-                                        rp2040_timer_alarm_cb,
-                                        &s->alarm_timer[i]);
+        rp2040_event_init(&s->alarm_timer[i], s->sched,
+                          rp2040_timer_alarm_cb, s);
     }
 }
 
 static const VMStateDescription vmstate_rp2040_timer = {
     .name = TYPE_RP2040_TIMER,
-    .version_id = 1,
-    .minimum_version_id = 1,
+    .version_id = 2,
+    .minimum_version_id = 2,
     .fields = (VMStateField[]) {
         VMSTATE_UINT64(time_base, RP2040TimerState),
         VMSTATE_UINT64(latched_count, RP2040TimerState),
@@ -313,11 +495,20 @@ static const VMStateDescription vmstate_rp2040_timer = {
         VMSTATE_UINT32(intr, RP2040TimerState),
         VMSTATE_UINT32(inte, RP2040TimerState),
         VMSTATE_UINT32(intf, RP2040TimerState),
-        VMSTATE_TIMER_PTR_ARRAY(alarm_timer, RP2040TimerState, 4),
+        VMSTATE_RP2040_EVENT_ARRAY(alarm_timer, RP2040TimerState, 4),
         VMSTATE_END_OF_LIST()
     }
 };
 
+static Property rp2040_timer_properties[] = {
+    DEFINE_PROP_ON_OFF_AUTO("poll-fast-forward", RP2040TimerState,
+                            poll_ff_mode, ON_OFF_AUTO_AUTO),
+    DEFINE_PROP_STRING("time-mode", RP2040TimerState, time_mode_str),
+    DEFINE_PROP_LINK("scheduler", RP2040TimerState, sched, TYPE_RP2040_SCHED,
+                     RP2040SchedState *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void rp2040_timer_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -325,6 +516,11 @@ static void rp2040_timer_class_init(ObjectClass *klass, void *data)
     dc->realize = rp2040_timer_realize;
     dc->reset = rp2040_timer_reset;
     dc->vmsd = &vmstate_rp2040_timer;
+    device_class_set_props(dc, rp2040_timer_properties);
+    object_class_property_set_description(klass, "time-mode",
+        "Counter time source: virtual, icount (needs -icount), realtime "
+        "(needs the machine's realtime=on) or warp (needs -icount with "
+        "sleep=off)");
 }
 
 static const TypeInfo rp2040_timer_info = {
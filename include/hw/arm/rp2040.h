@@ -11,6 +11,13 @@
 
 #include "hw/sysbus.h"
 #include "hw/arm/armv7m.h"
+#include "hw/char/rp2040_uart.h"
+#include "hw/gpio/rp2040_gpio.h"
+#include "hw/misc/rp2040_sched.h"
+#include "hw/misc/rp2040_sio.h"
+#include "hw/misc/rp2040_testctl.h"
+#include "hw/misc/rp2040_xip.h"
+#include "hw/timer/rp2040_timer.h"
 #include "qom/object.h"
 
 #define TYPE_RP2040_SOC "rp2040-soc"
@@ -24,18 +31,16 @@ OBJECT_DECLARE_SIMPLE_TYPE(RP2040State, RP2040_SOC)
 
 #define RP2040_XIP_BASE         0x10000000
 #define RP2040_XIP_SIZE         (16 * 1024 * 1024)
+#define RP2040_XIP_CTRL_BASE    0x14000000
+#define RP2040_XIP_SRAM_BASE    0x15000000
+
+/* Flash fitted to a stock Pico; the XIP window is larger */
+#define RP2040_FLASH_SIZE_DEFAULT   (2 * 1024 * 1024)
+#define RP2040_FLASH_SECTOR_SIZE    4096
 
 #define RP2040_SRAM_BASE        0x20000000
 #define RP2040_SRAM_SIZE        (264 * 1024)
 
-/* Forward declarations for peripherals */
-typedef struct RP2040UARTState RP2040UARTState;
-typedef struct RP2040GPIOState RP2040GPIOState;
-typedef struct RP2040TimerState RP2040TimerState;
-typedef struct RP2040DMAState RP2040DMAState;
-typedef struct RP2040PIOState RP2040PIOState;
-typedef struct RP2040SIOState RP2040SIOState;
-
 typedef struct RP2040State {
     SysBusDevice parent_obj;
 
@@ -46,15 +51,31 @@ typedef struct RP2040State {
     MemoryRegion xip;
     MemoryRegion peripherals;
     
-    /* Peripherals */
-    RP2040UARTState *uart[2];
-    RP2040GPIOState *gpio;
-    RP2040TimerState *timer;
-    RP2040DMAState *dma;
-    RP2040PIOState *pio[2];
-    RP2040SIOState *sio;
+    /*
+     * System memory with the flash mapped directly, for loading firmware
+     * whatever sits in front of it in the XIP window
+     */
+    MemoryRegion loader_root;
+    MemoryRegion loader_sysmem;
+    MemoryRegion loader_flash;
+    AddressSpace loader_as;
+    
+    /* Event scheduler shared by all peripherals */
+    RP2040SchedState sched;
+    
+    /* Core peripherals */
+    RP2040UARTState uart[2];
+    RP2040GPIOState gpio;
+    RP2040SIOState sio;
+    RP2040TimerState timer;
+    RP2040XIPState xip_ctrl;
+    RP2040TestCtlState testctl;    /* QEMU-only test control */
     
     uint32_t num_cpus;
+    uint32_t time_dilation;
+    bool realtime;
+    uint32_t flash_size;
+    char *flash_image;
 } RP2040State;
 
 #endif /* HW_ARM_RP2040_H */
\ No newline at end of file
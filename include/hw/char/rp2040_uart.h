@@ -11,6 +11,9 @@
 
 #include "hw/sysbus.h"
 #include "chardev/char-fe.h"
+#include "hw/char/rp2040_uart_expect.h"
+#include "hw/misc/rp2040_sched.h"
+#include "qemu/notify.h"
 #include "qom/object.h"
 
 #define TYPE_RP2040_UART "rp2040-uart"
@@ -18,12 +21,20 @@ OBJECT_DECLARE_SIMPLE_TYPE(RP2040UARTState, RP2040_UART)
 
 #define FIFO_SIZE 32
 
+/* Character timing model, selected with the "pacing" property */
+typedef enum RP2040UARTPacing {
+    RP2040_UART_PACING_TURBO,     /* move bytes as fast as the host allows */
+    RP2040_UART_PACING_ACCURATE,  /* time bytes from IBRD/FBRD and LCR_H */
+} RP2040UARTPacing;
+
 typedef struct RP2040UARTState {
     SysBusDevice parent_obj;
     
     MemoryRegion mmio;
     CharBackend chr;
     qemu_irq irq;
+    qemu_irq tx_dreq;  /* DMA request lines, driven from UARTDMACR */
+    qemu_irq rx_dreq;
     
     /* Registers */
     uint32_t dr;      /* Data register */
@@ -45,7 +56,78 @@ typedef struct RP2040UARTState {
     uint32_t rx_fifo_len;
     uint32_t rx_fifo_rd;
     uint32_t rx_fifo_wr;
+    uint8_t tx_fifo[FIFO_SIZE];
     uint32_t tx_fifo_len;
+    uint32_t tx_fifo_rd;
+    uint32_t tx_fifo_wr;
+    uint32_t tx_fr_reads;   /* FR reads since the last DR write */
+
+    /*
+     * Host-side staging ring in front of the RX FIFO.  Input that arrives
+     * while the FIFO is full is parked here and fed to the FIFO as the
+     * guest drains it, instead of being dropped.
+     */
+    uint8_t *rx_stage;
+    uint32_t rx_stage_size;
+    uint32_t rx_stage_len;
+    uint32_t rx_stage_rd;
+    uint32_t rx_stage_wr;
+    
+    /* RX statistics, exposed as read-only QOM properties */
+    uint64_t rx_delivered;
+    uint64_t rx_dropped;
+    uint32_t rx_stage_peak;
+    
+    /*
+     * In turbo mode tx_timer is the deadline for draining a partially
+     * filled TX FIFO; in accurate mode it marks the end of the character
+     * being shifted out.  rx_timer paces received characters and
+     * rt_timer drives the receive timeout interrupt.  All three are
+     * events of the SoC scheduler, in guest time.
+     */
+    RP2040SchedState *sched;
+    RP2040Event tx_timer;
+    RP2040Event rx_timer;
+    RP2040Event rt_timer;
+    
+    /*
+     * Optional asynchronous output: TX data goes into tx_ring and is
+     * written to the chardev from the main loop by tx_bh, or by a chardev
+     * watch (tx_watch) while the backend is not ready.
+     */
+    bool tx_async;
+    uint8_t *tx_ring;
+    uint32_t tx_ring_size;
+    uint32_t tx_ring_head;
+    uint32_t tx_ring_tail;
+    QEMUBH *tx_bh;
+    guint tx_watch;
+    
+    /* Timestamped binary capture of all TX and RX bytes */
+    char *capture_path;
+    int capture_fd;
+    uint8_t *capture_map;   /* current chunk of the capture file */
+    uint64_t capture_base;  /* file offset of capture_map */
+    uint32_t capture_pos;   /* write position within capture_map */
+    
+    /* Expectation script matched against the TX output */
+    char *expect_path;
+    RP2040UARTExpect *expect;
+    
+    Notifier shutdown_notifier;
+    
+    /* Poll-loop fast-forward */
+    bool poll_ff;
+    uint32_t poll_count;    /* consecutive FR reads with an unchanged value */
+    uint32_t poll_fr;
+    
+    /* Properties */
+    char *pacing_str;
+    uint32_t clk_freq;  /* UARTCLK (clk_peri) in Hz */
+    RP2040UARTPacing pacing;
 } RP2040UARTState;
 
+void rp2040_uart_flush(RP2040UARTState *s);
+bool rp2040_uart_set_chardev(RP2040UARTState *s, Chardev *chr, Error **errp);
+
 #endif /* HW_CHAR_RP2040_UART_H */
\ No newline at end of file
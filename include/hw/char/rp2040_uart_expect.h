@@ -0,0 +1,52 @@
+/*
+ * RP2040 UART expectation scripts
+ *
+ * Copyright (c) 2025 QEMU RP2040 Development Team
+ *
+ * This code is licensed under the GPL version 2 or later.
+ */
+
+#ifndef HW_CHAR_RP2040_UART_EXPECT_H
+#define HW_CHAR_RP2040_UART_EXPECT_H
+
+#include "hw/misc/rp2040_sched.h"
+
+/* QEMU exit status for each verdict */
+#define RP2040_EXPECT_EXIT_PASS     0
+#define RP2040_EXPECT_EXIT_MISMATCH 1   /* a fail pattern matched */
+#define RP2040_EXPECT_EXIT_TIMEOUT  2   /* a step missed its deadline */
+
+/* Output kept for the pending step; older bytes are dropped beyond this */
+#define RP2040_EXPECT_BUF_MAX       4096
+
+typedef struct RP2040UARTExpect {
+    char *name;
+    RP2040SchedState *sched;
+    RP2040Event deadline;   /* of the pending step, a watchdog event */
+    
+    GArray *steps;          /* RP2040ExpectPattern, in order */
+    GArray *fails;          /* RP2040ExpectPattern, checked throughout */
+    uint32_t step;          /* index of the pending step */
+    int64_t base_ns;        /* guest time of the last reset */
+    
+    GString *pending;       /* output since the last step matched */
+    GString *line;          /* output since the last newline */
+    bool done;
+    
+    /* pending and line as migrated */
+    uint32_t mig_pending_len;
+    uint32_t mig_line_len;
+    uint8_t mig_pending[RP2040_EXPECT_BUF_MAX];
+    uint8_t mig_line[RP2040_EXPECT_BUF_MAX];
+} RP2040UARTExpect;
+
+RP2040UARTExpect *rp2040_uart_expect_new(const char *name, const char *path,
+                                         RP2040SchedState *sched,
+                                         Error **errp);
+void rp2040_uart_expect_free(RP2040UARTExpect *ex);
+void rp2040_uart_expect_reset(RP2040UARTExpect *ex);
+void rp2040_uart_expect_feed(RP2040UARTExpect *ex, uint8_t ch);
+
+extern const VMStateDescription vmstate_rp2040_uart_expect;
+
+#endif /* HW_CHAR_RP2040_UART_EXPECT_H */
\ No newline at end of file
@@ -10,6 +10,9 @@
 #define HW_GPIO_RP2040_GPIO_H
 
 #include "hw/sysbus.h"
+#include "hw/misc/rp2040_sched.h"
+#include "qemu/notify.h"
+#include "qemu/thread.h"
 #include "qom/object.h"
 
 #define TYPE_RP2040_GPIO "rp2040-gpio"
@@ -17,6 +20,22 @@ OBJECT_DECLARE_SIMPLE_TYPE(RP2040GPIOState, RP2040_GPIO)
 
 #define GPIO_NUM_PINS 30
 
+/* One entry of the VCD recorder ring */
+typedef struct RP2040GPIOTraceEvent {
+    uint64_t time;      /* guest time in ns */
+    uint32_t value;     /* pin word, or FUNCSEL for RP2040_GPIO_EV_FUNCSEL */
+    uint8_t kind;
+    uint8_t pin;
+} RP2040GPIOTraceEvent;
+
+enum {
+    RP2040_GPIO_EV_IN,
+    RP2040_GPIO_EV_OUT,
+    RP2040_GPIO_EV_OE,
+    RP2040_GPIO_EV_FUNCSEL,
+    RP2040_GPIO_EV_END,
+};
+
 typedef struct RP2040GPIOState {
     SysBusDevice parent_obj;
     
@@ -34,9 +53,68 @@ typedef struct RP2040GPIOState {
     uint32_t proc0_intf[4];
     uint32_t proc1_inte[4];
     uint32_t proc1_intf[4];
+    
+    /* Input level of each pin, one bit per pin */
+    uint32_t in_level;
+    
+    /*
+     * Caches for word-parallel interrupt evaluation: the interrupt kinds
+     * each pin senses, laid out like INTR, and per core a bitmap of the
+     * INTR registers with enabled pending bits.
+     */
+    uint32_t irq_sense[4];
+    uint32_t proc_pending[2];
+    
+    /* Output level and output enable, mirrored from SIO */
+    uint32_t out_level;
+    uint32_t oe;
+    
+    /* Optional VCD waveform recorder, drained by a writer thread */
+    char *vcd_path;
+    FILE *vcd_file;
+    RP2040GPIOTraceEvent *vcd_ring;     /* NULL when recording is off */
+    uint32_t vcd_head;
+    uint32_t vcd_tail;
+    uint64_t vcd_dropped;
+    uint64_t vcd_time_offset;   /* keeps VCD time monotonic across loads */
+    uint64_t vcd_last_time;
+    QEMUTimer *vcd_kick;
+    QemuThread vcd_thread;
+    QemuEvent vcd_event;
+    bool vcd_stop;
+    Notifier shutdown_notifier;
+    Notifier rewind_notifier;
+    
+    /* Optional stimulus playback from a memory-mapped CSV or VCD file */
+    char *stim_path;
+    GMappedFile *stim_file;
+    const char *stim_start;     /* first value change */
+    const char *stim_pos;       /* parse position */
+    const char *stim_end;
+    uint64_t stim_pos_offset;   /* stim_pos in the file, for migration */
+    uint64_t stim_size;         /* file size, checked on load */
+    bool stim_is_vcd;
+    GHashTable *stim_ids;       /* VCD identifier -> pin + 1 */
+    uint64_t stim_ts_mul;       /* VCD time units to ns */
+    uint64_t stim_ts_div;
+    uint64_t stim_vcd_time;
+    int64_t stim_base;          /* virtual time of stimulus time 0 */
+    bool stim_have_ev;          /* lookahead event below is valid */
+    uint64_t stim_ev_time;
+    uint32_t stim_ev_pin;
+    uint32_t stim_ev_level;
+    RP2040Event stim_timer;
+    
+    RP2040SchedState *sched;
 } RP2040GPIOState;
 
 /* Interface functions */
 void rp2040_gpio_set_input(RP2040GPIOState *s, int pin, int level);
+void rp2040_gpio_set_input_mask(RP2040GPIOState *s, uint32_t mask,
+                                uint32_t levels);
+void rp2040_gpio_set_output_mask(RP2040GPIOState *s, uint32_t mask,
+                                 uint32_t levels);
+void rp2040_gpio_set_oe_mask(RP2040GPIOState *s, uint32_t mask,
+                             uint32_t enables);
 
 #endif /* HW_GPIO_RP2040_GPIO_H */
\ No newline at end of file
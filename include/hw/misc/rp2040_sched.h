@@ -0,0 +1,126 @@
+/*
+ * RP2040 SoC event scheduler
+ *
+ * Copyright (c) 2025 QEMU RP2040 Development Team
+ *
+ * This code is licensed under the GPL version 2 or later.
+ */
+
+#ifndef HW_MISC_RP2040_SCHED_H
+#define HW_MISC_RP2040_SCHED_H
+
+#include "hw/qdev-core.h"
+#include "migration/vmstate.h"
+#include "qemu/notify.h"
+#include "qemu/timer.h"
+#include "qom/object.h"
+
+#define TYPE_RP2040_SCHED "rp2040-sched"
+OBJECT_DECLARE_SIMPLE_TYPE(RP2040SchedState, RP2040_SCHED)
+
+typedef void RP2040EventCB(void *opaque);
+
+/* Register writes remembered for diagnostics */
+#define RP2040_SCHED_LOG_SIZE 16
+
+typedef struct RP2040WriteRecord {
+    int64_t time_ns;
+    Object *dev;
+    uint32_t offset;
+    uint32_t value;
+} RP2040WriteRecord;
+
+/*
+ * A device deadline.  Deadlines are absolute guest time in ns, as
+ * returned by rp2040_sched_now_ns().  A watchdog event only checks on the
+ * guest (a test deadline, the hang detector): it fires when guest time
+ * gets there, but idle time is never skipped ahead to it.
+ */
+typedef struct RP2040Event {
+    RP2040SchedState *sched;
+    RP2040EventCB *cb;
+    void *opaque;
+    int64_t deadline;       /* -1 when not armed */
+    int heap_index;         /* position in the scheduler heap, or -1 */
+    bool watchdog;
+} RP2040Event;
+
+/*
+ * Guest time is the host clock scaled by time_dilation plus offset_ns,
+ * which grows when idle time is skipped.  All armed events sit in a
+ * binary min-heap and a single QEMUTimer is armed for the earliest one.
+ */
+struct RP2040SchedState {
+    DeviceState parent_obj;
+    
+    QEMUClockType clock;
+    QEMUTimer *timer;
+    int64_t timer_deadline; /* host deadline timer is armed for, or -1 */
+    bool dispatching;
+    VMChangeStateEntry *vm_state_change;    /* realtime clock only */
+    
+    RP2040Event **heap;
+    uint32_t heap_len;
+    uint32_t heap_size;
+    
+    int64_t offset_ns;
+    
+    /*
+     * Guest time devices have asked for from inside an access, added to
+     * offset_ns at the next dispatch; see rp2040_sched_stall()
+     */
+    int64_t stall_ns;
+    
+    /*
+     * Guest writes to the registers of the devices on this scheduler: a
+     * count as a sign of progress, and the latest ones for diagnostics
+     */
+    uint64_t writes;
+    RP2040WriteRecord write_log[RP2040_SCHED_LOG_SIZE];
+    
+    /*
+     * Called after a test run has been rewound to its checkpoint, for
+     * state that lives outside the guest: trace files, host-side checks
+     */
+    NotifierList rewind_notifiers;
+    
+    /* Properties */
+    uint32_t time_dilation;
+    bool realtime;
+};
+
+int64_t rp2040_sched_now_ns(RP2040SchedState *s);
+int64_t rp2040_sched_clock_ns(RP2040SchedState *s);
+int64_t rp2040_sched_next_deadline(RP2040SchedState *s);
+void rp2040_sched_advance(RP2040SchedState *s, int64_t ns);
+void rp2040_sched_stall(RP2040SchedState *s, int64_t ns);
+void rp2040_sched_note_write(RP2040SchedState *s, Object *dev,
+                             hwaddr offset, uint64_t value);
+void rp2040_sched_dump_writes(RP2040SchedState *s);
+void rp2040_sched_add_rewind_notifier(RP2040SchedState *s, Notifier *n);
+void rp2040_sched_notify_rewind(RP2040SchedState *s);
+RP2040SchedState *rp2040_sched_create(Object *parent, bool realtime,
+                                      Error **errp);
+
+void rp2040_event_init(RP2040Event *ev, RP2040SchedState *s,
+                       RP2040EventCB *cb, void *opaque);
+void rp2040_event_init_watchdog(RP2040Event *ev, RP2040SchedState *s,
+                                RP2040EventCB *cb, void *opaque);
+void rp2040_event_mod(RP2040Event *ev, int64_t deadline);
+void rp2040_event_del(RP2040Event *ev);
+
+static inline bool rp2040_event_pending(RP2040Event *ev)
+{
+    return ev->heap_index >= 0;
+}
+
+extern const VMStateDescription vmstate_rp2040_event;
+
+#define VMSTATE_RP2040_EVENT(_field, _state) \
+    VMSTATE_STRUCT(_field, _state, 0, vmstate_rp2040_event, RP2040Event)
+
+#define VMSTATE_RP2040_EVENT_ARRAY(_field, _state, _n) \
+    VMSTATE_STRUCT_ARRAY(_field, _state, _n, 0, vmstate_rp2040_event, \
+                         RP2040Event)
+
+#endif /* HW_MISC_RP2040_SCHED_H */
\ No newline at end of file
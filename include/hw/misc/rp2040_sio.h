@@ -0,0 +1,32 @@
+/*
+ * RP2040 single-cycle I/O (SIO) block
+ *
+ * Copyright (c) 2025 QEMU RP2040 Development Team
+ *
+ * This code is licensed under the GPL version 2 or later.
+ */
+
+#ifndef HW_MISC_RP2040_SIO_H
+#define HW_MISC_RP2040_SIO_H
+
+#include "hw/sysbus.h"
+#include "hw/gpio/rp2040_gpio.h"
+#include "qom/object.h"
+
+#define TYPE_RP2040_SIO "rp2040-sio"
+OBJECT_DECLARE_SIMPLE_TYPE(RP2040SIOState, RP2040_SIO)
+
+typedef struct RP2040SIOState {
+    SysBusDevice parent_obj;
+    
+    MemoryRegion mmio;
+    
+    /* Bank 0 GPIO output and output enable, one bit per pin */
+    uint32_t gpio_out;
+    uint32_t gpio_oe;
+    
+    /* Properties */
+    RP2040GPIOState *gpio;
+} RP2040SIOState;
+
+#endif /* HW_MISC_RP2040_SIO_H */
\ No newline at end of file
@@ -0,0 +1,55 @@
+/*
+ * RP2040 test control device
+ *
+ * Copyright (c) 2025 QEMU RP2040 Development Team
+ *
+ * This code is licensed under the GPL version 2 or later.
+ */
+
+#ifndef HW_MISC_RP2040_TESTCTL_H
+#define HW_MISC_RP2040_TESTCTL_H
+
+#include "hw/sysbus.h"
+#include "hw/char/rp2040_uart.h"
+#include "hw/misc/rp2040_sched.h"
+#include "qom/object.h"
+
+#define TYPE_RP2040_TESTCTL "rp2040-testctl"
+OBJECT_DECLARE_SIMPLE_TYPE(RP2040TestCtlState, RP2040_TESTCTL)
+
+/* Values for the EXIT register; a failure carries its code in [31:16] */
+#define RP2040_TESTCTL_EXIT_PASS    0x5555
+#define RP2040_TESTCTL_EXIT_FAIL    0x3333
+
+/* RAM regions saved with the checkpoint */
+#define RP2040_TESTCTL_NUM_RAM 2
+
+typedef struct RP2040TestCtlState {
+    SysBusDevice parent_obj;
+    
+    MemoryRegion mmio;
+    QEMUBH *bh;
+    
+    /* Work for the bottom half, set from the vCPU */
+    bool checkpoint_pending;
+    bool done_pending;
+    
+    /* Checkpoint: device state stream and a copy of each RAM region */
+    bool checkpointed;
+    uint8_t *dev_state;
+    size_t dev_state_len;
+    uint8_t *ram_copy[RP2040_TESTCTL_NUM_RAM];
+    
+    uint32_t run;               /* index of the current run */
+    Chardev *run_chr;           /* per-run chardev of the UART */
+    Chardev *boot_chr;          /* the UART's chardev before the first run */
+    
+    /* Properties */
+    MemoryRegion *ram[RP2040_TESTCTL_NUM_RAM];
+    RP2040UARTState *uart[2];   /* run-serial applies to UART0 */
+    RP2040SchedState *sched;    /* optional, notified of rewinds */
+    uint32_t runs;
+    char *run_serial;
+} RP2040TestCtlState;
+
+#endif /* HW_MISC_RP2040_TESTCTL_H */
\ No newline at end of file
@@ -0,0 +1,77 @@
+/*
+ * RP2040 XIP cache and control registers
+ *
+ * Copyright (c) 2025 QEMU RP2040 Development Team
+ *
+ * This code is licensed under the GPL version 2 or later.
+ */
+
+#ifndef HW_MISC_RP2040_XIP_H
+#define HW_MISC_RP2040_XIP_H
+
+#include "hw/sysbus.h"
+#include "hw/misc/rp2040_sched.h"
+#include "qom/object.h"
+
+#define TYPE_RP2040_XIP "rp2040-xip"
+OBJECT_DECLARE_SIMPLE_TYPE(RP2040XIPState, RP2040_XIP)
+
+/* 16 KB, 2-way set-associative, 8-byte lines */
+#define RP2040_XIP_CACHE_SIZE   (16 * 1024)
+#define RP2040_XIP_CACHE_WAYS   2
+#define RP2040_XIP_CACHE_LINE   8
+#define RP2040_XIP_CACHE_SETS   \
+    (RP2040_XIP_CACHE_SIZE / (RP2040_XIP_CACHE_WAYS * RP2040_XIP_CACHE_LINE))
+
+/* The XIP window aliases, 16 MB apart from XIP_BASE */
+typedef enum RP2040XIPMode {
+    RP2040_XIP_MODE_CACHED,         /* look up and allocate */
+    RP2040_XIP_MODE_NOALLOC,        /* look up, no allocation on miss */
+    RP2040_XIP_MODE_NOCACHE,        /* no lookup, always allocate */
+    RP2040_XIP_MODE_NOCACHE_NOALLOC, /* bypass the cache */
+    RP2040_XIP_NUM_MODES,
+} RP2040XIPMode;
+
+typedef struct RP2040XIPView {
+    RP2040XIPState *xip;
+    RP2040XIPMode mode;
+    MemoryRegion mr;
+} RP2040XIPView;
+
+/*
+ * sysbus MMIO regions: 0 is XIP_CTRL, 1 + mode is the XIP window for each
+ * RP2040XIPMode and RP2040_XIP_NUM_MODES + 1 is XIP_SRAM.
+ */
+typedef struct RP2040XIPState {
+    SysBusDevice parent_obj;
+    
+    MemoryRegion ctrl_mmio;     /* XIP_CTRL registers */
+    RP2040XIPView view[RP2040_XIP_NUM_MODES];   /* the XIP window */
+    MemoryRegion sram;          /* the cache as SRAM while disabled */
+    
+    /* Control registers */
+    uint32_t ctrl;
+    uint32_t ctr_hit;
+    uint32_t ctr_acc;
+    uint32_t stream_addr;
+    uint32_t stream_ctr;
+    
+    /*
+     * Cache tags, (tag << 1) | valid per way, and the way to replace next
+     * in each set.  Data is always read from the flash itself.
+     */
+    uint32_t tags[RP2040_XIP_CACHE_SETS][RP2040_XIP_CACHE_WAYS];
+    uint8_t victim[RP2040_XIP_CACHE_SETS];
+    
+    /* Host-side totals, not cleared by the guest */
+    uint64_t stat_hits;
+    uint64_t stat_misses;
+    
+    /* Properties */
+    MemoryRegion *flash;
+    RP2040SchedState *sched;
+    bool cache_model;
+    uint32_t miss_latency_ns;
+} RP2040XIPState;
+
+#endif /* HW_MISC_RP2040_XIP_H */
\ No newline at end of file
@@ -10,12 +10,21 @@
 #define HW_TIMER_RP2040_TIMER_H
 
 #include "hw/sysbus.h"
-#include "qemu/timer.h"
+#include "hw/misc/rp2040_sched.h"
+#include "qapi/qapi-types-common.h"
 #include "qom/object.h"
 
 #define TYPE_RP2040_TIMER "rp2040-timer"
 OBJECT_DECLARE_SIMPLE_TYPE(RP2040TimerState, RP2040_TIMER)
 
+/* Time source of the counter, selected with the "time-mode" property */
+typedef enum RP2040TimerTimeMode {
+    RP2040_TIMER_TIME_VIRTUAL,  /* QEMU_CLOCK_VIRTUAL, whatever it is tied to */
+    RP2040_TIMER_TIME_ICOUNT,   /* virtual clock locked to -icount */
+    RP2040_TIMER_TIME_REALTIME, /* host wall-clock time */
+    RP2040_TIMER_TIME_WARP,     /* icount, idle time skipped to next alarm */
+} RP2040TimerTimeMode;
+
 typedef struct RP2040TimerState {
     SysBusDevice parent_obj;
     
@@ -40,8 +49,20 @@ typedef struct RP2040TimerState {
     uint32_t inte;
     uint32_t intf;
     
-    /* QEMU timers for alarms */
-    QEMUTimer *alarm_timer[4];
+    /* Scheduler events for alarms */
+    RP2040SchedState *sched;
+    RP2040Event alarm_timer[4];
+    
+    /* Poll-loop fast-forward */
+    OnOffAuto poll_ff_mode;
+    bool poll_ff;
+    uint32_t poll_count;    /* consecutive tight counter reads */
+    int64_t poll_last_ns;   /* virtual time of the last counter read */
+    int64_t poll_start_ns;  /* guest time of the first read of the loop */
+    
+    /* Time source */
+    char *time_mode_str;
+    RP2040TimerTimeMode time_mode;
 } RP2040TimerState;
 
 #endif /* HW_TIMER_RP2040_TIMER_H */
\ No newline at end of file
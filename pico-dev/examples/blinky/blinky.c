@@ -11,6 +11,10 @@
 // LED is on GPIO 25 on Pico
 #define LED_PIN 25
 
+// QEMU test control EXIT register: ends the run with a status
+#define QEMU_TEST_EXIT 0x40068010
+#define QEMU_TEST_PASS 0x5555
+
 // Timing constants
 #define BLINK_DELAY_MS 500
 #define TEST_DURATION_SEC 10
@@ -68,6 +72,8 @@ int main() {
     // For QEMU testing, we'll exit after the test
     // In real hardware, this would continue blinking
 #ifdef QEMU_TEST
+    // Stop QEMU right away with a passing status
+    *(volatile uint32_t *)QEMU_TEST_EXIT = QEMU_TEST_PASS;
     return 0;
 #else
     // Continue blinking forever on real hardware
@@ -0,0 +1,312 @@
+#!/usr/bin/env python3
+"""
+Run many RP2040 firmware tests in parallel on raspberrypi-pico machines
+
+Each test is one QEMU process.  Firmware is turned into a full flash image
+once, in the output directory, and every run of it maps that image with
+-machine flash-image=, so the page cache holds a single copy however many
+workers use it.  Firmware that loads outside flash (no_flash builds) is
+passed with -kernel instead.
+
+A test passes when QEMU exits with the expected status, as set through the
+test control EXIT register or an rp2040-uart expect script; runs stopped
+by hang-timeout or the host-side timeout fail.  UART output and stderr
+are kept per test, and a JSON report sums up the whole run.
+
+Usage:
+    rp2040-farm.py test_uart.bin test_gpio.elf app.uf2
+    rp2040-farm.py -j 8 --spec tests.json --report report.json
+
+A spec file holds a list of tests; only "firmware" is required, and
+relative paths are taken from the spec file's directory.  "expect" is an
+expect script for UART0 and "expect_uart1" one for UART1:
+
+    [
+      {"name": "uart", "firmware": "test_uart.bin"},
+      {"name": "shell", "firmware": "app.uf2", "expect": "shell.expect",
+       "timeout": 120, "hang_timeout": 20000, "args": ["-icount", "4"]},
+      {"name": "fault", "firmware": "fault.elf", "exit_status": 3}
+    ]
+
+tests/rp2040/farm.json is a complete example.
+"""
+
+import argparse
+import concurrent.futures
+import hashlib
+import json
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+XIP_BASE = 0x10000000
+FLASH_SIZE_DEFAULT = 2 * 1024 * 1024
+HANG_EXIT = 124             # raspberrypi-pico hang-timeout
+UARTS = ("uart0", "uart1")
+EXPECT_KEYS = {"uart0": "expect", "uart1": "expect_uart1"}
+
+UF2_MAGIC = (0x0A324655, 0x9E5D5157, 0x0AB16F30)
+UF2_BLOCK = struct.Struct("<8I476sI")
+UF2_FLAG_NOT_MAIN_FLASH = 0x00000001
+UF2_FLAG_FAMILY_ID = 0x00002000
+UF2_FAMILY_RP2040 = 0xE48BFF56
+
+PT_LOAD = 1
+
+
+def parse_size(text):
+    units = {"K": 1 << 10, "M": 1 << 20}
+    text = text.strip().upper()
+    if text[-1:] in units:
+        return int(text[:-1], 0) * units[text[-1]]
+    return int(text, 0)
+
+
+def flash_chunks(data):
+    """
+    Yield (address, bytes) for everything the firmware loads, or raise
+    ValueError for an image this script does not understand
+    """
+    if data[:4] == b"\x7fELF":
+        if data[4] != 1 or data[5] != 1:
+            raise ValueError("not a 32-bit little-endian ELF")
+        phoff, = struct.unpack_from("<I", data, 28)
+        phentsize, phnum = struct.unpack_from("<HH", data, 42)
+        for i in range(phnum):
+            (p_type, p_offset, _, p_paddr,
+             p_filesz, *_) = struct.unpack_from("<8I", data,
+                                                phoff + i * phentsize)
+            if p_type == PT_LOAD and p_filesz:
+                yield p_paddr, data[p_offset:p_offset + p_filesz]
+    elif len(data) >= UF2_BLOCK.size and \
+            struct.unpack_from("<2I", data) == UF2_MAGIC[:2]:
+        for off in range(0, len(data) - UF2_BLOCK.size + 1, UF2_BLOCK.size):
+            (magic0, magic1, flags, addr, size, _, _, family,
+             payload, magic_end) = UF2_BLOCK.unpack_from(data, off)
+            if (magic0, magic1, magic_end) != UF2_MAGIC:
+                raise ValueError(f"bad UF2 block at offset {off}")
+            if flags & UF2_FLAG_NOT_MAIN_FLASH:
+                continue
+            if flags & UF2_FLAG_FAMILY_ID and family != UF2_FAMILY_RP2040:
+                continue
+            yield addr, payload[:size]
+    else:
+        # Raw binary, linked to run from the start of flash
+        yield XIP_BASE, data
+
+
+def build_flash_image(firmware, flash_size, cache_dir):
+    """
+    Return the path of a flash image holding the firmware, creating it on
+    first use, or None if the firmware loads outside flash
+    """
+    with open(firmware, "rb") as f:
+        data = f.read()
+
+    key = hashlib.sha256(data + flash_size.to_bytes(4, "little")).hexdigest()
+    path = os.path.join(cache_dir, key[:16] + ".img")
+    if os.path.exists(path):
+        return path
+
+    image = bytearray(b"\xff" * flash_size)
+    for addr, chunk in flash_chunks(data):
+        if addr < XIP_BASE or addr + len(chunk) > XIP_BASE + flash_size:
+            return None
+        image[addr - XIP_BASE:addr - XIP_BASE + len(chunk)] = chunk
+
+    # Atomic, in case two workers build the same image
+    fd, tmp = tempfile.mkstemp(dir=cache_dir, suffix=".tmp")
+    with os.fdopen(fd, "wb") as f:
+        f.write(image)
+    os.replace(tmp, path)
+    return path
+
+
+def load_tests(args):
+    if args.spec:
+        with open(args.spec) as f:
+            tests = json.load(f)
+        base = os.path.dirname(os.path.abspath(args.spec))
+        for test in tests:
+            for key in ("firmware", *EXPECT_KEYS.values()):
+                if key in test:
+                    test[key] = os.path.join(base, test[key])
+    else:
+        tests = [{"firmware": fw} for fw in args.firmware]
+
+    names = set()
+    for test in tests:
+        if "firmware" not in test:
+            sys.exit(f"{args.spec}: test without \"firmware\"")
+        name = test.get("name") or \
+            os.path.splitext(os.path.basename(test["firmware"]))[0]
+        unique, n = name, 1
+        while unique in names:
+            n += 1
+            unique = f"{name}-{n}"
+        names.add(unique)
+        test["name"] = unique
+    return tests
+
+
+def stage_expect(test, args):
+    """
+    Copy the test's expect scripts to OUT/NAME.UART.expect and return the
+    template that hands each UART its own, or None without any.  -global
+    sets the property on both UARTs, so one plain path cannot tell them
+    apart.
+    """
+    name = test["name"]
+    staged = False
+    for uart in UARTS:
+        path = os.path.join(args.out, f"{name}.{uart}.expect")
+        if EXPECT_KEYS[uart] in test:
+            shutil.copyfile(test[EXPECT_KEYS[uart]], path)
+            staged = True
+        elif os.path.exists(path):
+            # Left over from an earlier run of a test with this name
+            os.remove(path)
+    return os.path.join(args.out, f"{name}.%s.expect") if staged else None
+
+
+def run_test(test, args, images):
+    name = test["name"]
+    logs = {uart: os.path.join(args.out, f"{name}.{uart}.log")
+            for uart in UARTS}
+    logs["stderr"] = os.path.join(args.out, f"{name}.stderr.log")
+    machine = ["raspberrypi-pico", f"flash-size={args.flash_size}",
+               f"hang-timeout={test.get('hang_timeout', args.hang_timeout)}"]
+    cmd = [args.qemu]
+    image = images[test["firmware"]]
+    if image:
+        machine.append(f"flash-image={image}")
+    else:
+        cmd += ["-kernel", test["firmware"]]
+    cmd += ["-machine", ",".join(machine),
+            "-display", "none", "-monitor", "none",
+            "-serial", f"file:{logs['uart0']}",
+            "-serial", f"file:{logs['uart1']}"]
+    expect = stage_expect(test, args)
+    if expect:
+        cmd += ["-global", f"rp2040-uart.expect={expect}"]
+    cmd += test.get("args", [])
+
+    timeout = test.get("timeout", args.timeout)
+    expected = test.get("exit_status", 0)
+    start = time.monotonic()
+    with open(logs["stderr"], "wb") as err:
+        try:
+            proc = subprocess.run(cmd, stdin=subprocess.DEVNULL,
+                                  stdout=err, stderr=err, timeout=timeout)
+            status = proc.returncode
+        except subprocess.TimeoutExpired:
+            status = None
+    elapsed = time.monotonic() - start
+
+    if status is None:
+        result = "timeout"
+    elif status == expected:
+        result = "pass"
+    elif status == HANG_EXIT:
+        result = "hang"
+    else:
+        result = "fail"
+
+    return {
+        "name": name,
+        "firmware": test["firmware"],
+        "result": result,
+        "exit_status": status,
+        "expected_status": expected,
+        "seconds": round(elapsed, 3),
+        "shared_flash": image is not None,
+        "logs": logs,
+        "command": cmd,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Run RP2040 firmware tests in parallel")
+    parser.add_argument("firmware", nargs="*",
+                        help="ELF, UF2 or raw flash binaries to run")
+    parser.add_argument("--spec", help="JSON list of tests to run")
+    parser.add_argument("-j", "--jobs", type=int, default=os.cpu_count(),
+                        help="QEMU processes to run at once "
+                             "(default: one per host CPU)")
+    parser.add_argument("--qemu",
+                        default=os.environ.get("QEMU", "qemu-system-arm"),
+                        help="QEMU binary (default: $QEMU or "
+                             "qemu-system-arm)")
+    parser.add_argument("--timeout", type=float, default=60,
+                        help="host seconds before a test is killed "
+                             "(default 60)")
+    parser.add_argument("--hang-timeout", type=int, default=10000,
+                        help="guest ms without progress before QEMU stops "
+                             "a test, 0 for off (default 10000)")
+    parser.add_argument("--flash-size", default="2M",
+                        help="flash size of every machine (default 2M)")
+    parser.add_argument("--out", default="farm-results",
+                        help="directory for logs and flash images "
+                             "(default farm-results)")
+    parser.add_argument("--report",
+                        help="JSON report path (default OUT/report.json)")
+    args = parser.parse_args()
+
+    if bool(args.spec) == bool(args.firmware):
+        parser.error("give either firmware files or --spec")
+    flash_size = parse_size(args.flash_size)
+    report_path = args.report or os.path.join(args.out, "report.json")
+    cache_dir = os.path.join(args.out, "flash")
+    os.makedirs(cache_dir, exist_ok=True)
+
+    tests = load_tests(args)
+    images = {}
+    for firmware in {test["firmware"] for test in tests}:
+        try:
+            images[firmware] = build_flash_image(firmware, flash_size,
+                                                 cache_dir)
+        except (OSError, ValueError, struct.error) as e:
+            sys.exit(f"{firmware}: {e}")
+
+    start = time.monotonic()
+    results = []
+    with concurrent.futures.ThreadPoolExecutor(args.jobs) as pool:
+        futures = [pool.submit(run_test, test, args, images)
+                   for test in tests]
+        for future in concurrent.futures.as_completed(futures):
+            r = future.result()
+            results.append(r)
+            print(f"{r['result'].upper():8} {r['name']} "
+                  f"({r['seconds']:.1f}s, status {r['exit_status']})",
+                  flush=True)
+
+    order = {test["name"]: i for i, test in enumerate(tests)}
+    results.sort(key=lambda r: order[r["name"]])
+    summary = {"total": len(results)}
+    for result in ("pass", "fail", "hang", "timeout"):
+        summary[result] = sum(r["result"] == result for r in results)
+
+    report = {
+        "qemu": args.qemu,
+        "jobs": args.jobs,
+        "seconds": round(time.monotonic() - start, 3),
+        "summary": summary,
+        "tests": results,
+    }
+    with open(report_path, "w") as f:
+        json.dump(report, f, indent=2)
+        f.write("\n")
+
+    print(f"{summary['pass']}/{summary['total']} passed, "
+          f"{summary['fail']} failed, {summary['hang']} hung, "
+          f"{summary['timeout']} timed out; report in {report_path}")
+    sys.exit(0 if summary["pass"] == summary["total"] else 1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""
+Decode rp2040-uart capture files
+
+A capture is written by an rp2040-uart device started with
+-global rp2040-uart.capture=<path>.  It holds an 8-byte magic followed by
+9-byte records: a little-endian 64-bit virtual-clock timestamp in ns, with
+bit 63 set for received bytes and bit 62 set in every record, and the data
+byte.  A capture from a QEMU that was killed ends in zeroes up to the next
+1 MiB boundary; decoding stops at the first record without bit 62.
+
+Usage:
+    rp2040-uart-capture.py capture.bin           # timestamped text lines
+    rp2040-uart-capture.py --csv capture.bin     # one CSV row per byte
+"""
+
+import argparse
+import csv
+import mmap
+import os
+import struct
+import sys
+
+MAGIC = b"RP2UCAP2"
+MAGIC_V1 = b"RP2UCAP1"      # no VALID_FLAG, only complete if QEMU exited
+RECORD = struct.Struct("<QB")
+RX_FLAG = 1 << 63
+VALID_FLAG = 1 << 62
+
+
+def records(path):
+    with open(path, "rb") as f:
+        if os.fstat(f.fileno()).st_size == 0:
+            # Created, but QEMU died before writing the header
+            return
+        with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as m:
+            magic = m[:len(MAGIC)]
+            if magic not in (MAGIC, MAGIC_V1):
+                sys.exit(f"{path}: not an rp2040-uart capture file")
+            end = len(m) - (len(m) - len(MAGIC)) % RECORD.size
+            for off in range(len(MAGIC), end, RECORD.size):
+                stamp, byte = RECORD.unpack_from(m, off)
+                if magic == MAGIC:
+                    if not stamp & VALID_FLAG:
+                        break
+                    stamp &= ~VALID_FLAG
+                yield stamp & ~RX_FLAG, "RX" if stamp & RX_FLAG else "TX", byte
+
+
+def write_csv(path, out):
+    writer = csv.writer(out)
+    writer.writerow(["time_ns", "direction", "byte", "char"])
+    for stamp, direction, byte in records(path):
+        char = chr(byte) if 0x20 <= byte < 0x7F else ""
+        writer.writerow([stamp, direction, f"0x{byte:02x}", char])
+
+
+def write_text(path, out):
+    """Group bytes into lines per direction, stamped with the first byte"""
+    pending = {"TX": None, "RX": None}
+
+    def emit(direction):
+        stamp, data = pending[direction]
+        text = data.decode("utf-8", errors="backslashreplace")
+        out.write(f"[{stamp / 1e9:14.9f}] {direction}: {text}\n")
+        pending[direction] = None
+
+    for stamp, direction, byte in records(path):
+        if byte == ord("\r"):
+            continue
+        if pending[direction] is None:
+            pending[direction] = (stamp, bytearray())
+        if byte == ord("\n"):
+            emit(direction)
+        else:
+            pending[direction][1].append(byte)
+
+    for direction in ("TX", "RX"):
+        if pending[direction] is not None:
+            emit(direction)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode rp2040-uart captures")
+    parser.add_argument("capture", help="capture file to decode")
+    parser.add_argument("--csv", action="store_true",
+                        help="emit one CSV row per byte instead of text")
+    args = parser.parse_args()
+
+    try:
+        if args.csv:
+            write_csv(args.capture, sys.stdout)
+        else:
+            write_text(args.capture, sys.stdout)
+    except BrokenPipeError:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,71 @@
+/*
+ * RP2040 UART expect test program
+ * Prints a fixed transcript for the rp2040-uart expect scripts in expect/
+ * and then sleeps, without using the test control EXIT register, so QEMU
+ * only ends through the script's verdict
+ */
+
+#include <stdint.h>
+
+/* UART0 Registers */
+#define UART0_BASE     0x40034000
+#define UART0_DR       (UART0_BASE + 0x000)
+#define UART0_FR       (UART0_BASE + 0x018)
+#define UART0_IBRD     (UART0_BASE + 0x024)
+#define UART0_FBRD     (UART0_BASE + 0x028)
+#define UART0_LCR_H    (UART0_BASE + 0x02C)
+#define UART0_CR       (UART0_BASE + 0x030)
+
+/* Flag Register bits */
+#define UART_FR_TXFF   (1 << 5)  /* TX FIFO full */
+
+/* Control Register bits */
+#define UART_CR_UARTEN (1 << 0)  /* UART enable */
+#define UART_CR_TXE    (1 << 8)  /* TX enable */
+
+/* Line Control bits */
+#define UART_LCR_H_FEN (1 << 4)  /* FIFO enable */
+#define UART_LCR_H_WLEN_8 (3 << 5)  /* 8 bits */
+
+void uart_init(void) {
+    *(volatile uint32_t*)UART0_CR = 0;
+    
+    /* 115200 baud from a 48MHz UART clock */
+    *(volatile uint32_t*)UART0_IBRD = 26;
+    *(volatile uint32_t*)UART0_FBRD = 3;
+    
+    *(volatile uint32_t*)UART0_LCR_H = UART_LCR_H_FEN | UART_LCR_H_WLEN_8;
+    *(volatile uint32_t*)UART0_CR = UART_CR_UARTEN | UART_CR_TXE;
+}
+
+void uart_putc(char c) {
+    while (*(volatile uint32_t*)UART0_FR & UART_FR_TXFF);
+    *(volatile uint32_t*)UART0_DR = c;
+}
+
+/* Lines end in CRLF, as with the SDK's stdio */
+void uart_puts(const char *s) {
+    while (*s) {
+        if (*s == '\n') {
+            uart_putc('\r');
+        }
+        uart_putc(*s++);
+    }
+}
+
+int main(void) {
+    uart_init();
+    
+    uart_puts("expect test\n");
+    uart_puts("count=3\n");
+    uart_puts("value=42\n");
+    uart_puts("WARN battery low\n");
+    
+    /* A prompt without a line end, as a shell would leave it */
+    uart_puts("prompt> ");
+    
+    /* Nothing else happens; a script step still pending times out */
+    for (;;) {
+        __asm__ volatile ("wfi");
+    }
+}
\ No newline at end of file
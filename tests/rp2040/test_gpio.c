@@ -21,6 +21,9 @@
 #define GPIO_OE_SET    (SIO_BASE + 0x24)
 #define GPIO_OE_CLR    (SIO_BASE + 0x28)
 
+#define STATUS_OUTTOPAD (1 << 9)
+#define STATUS_OETOPAD  (1 << 13)
+
 /* Timer for delays */
 #define TIMER_BASE     0x40054000
 #define TIMELR         (TIMER_BASE + 0x0C)
@@ -98,6 +101,17 @@ void uart_puthex(uint32_t val) {
     }
 }
 
+static int failures;
+
+void check(const char *what, int ok) {
+    if (!ok) {
+        uart_puts("  FAIL: ");
+        uart_puts(what);
+        uart_puts("\n");
+        failures++;
+    }
+}
+
 int main(void) {
     /* Initialize UART for debug output */
     *(volatile uint32_t*)(UART0_BASE + 0x030) = 0x301; /* Enable UART */
@@ -121,11 +135,13 @@ int main(void) {
     uart_puts("  - Set GPIO25 high: ");
     uart_puthex(gpio_get_out(LED_PIN));
     uart_puts("\n");
+    check("GPIO25 set", gpio_get_out(LED_PIN) == 1);
     
     gpio_clear(LED_PIN);
     uart_puts("  - Set GPIO25 low: ");
     uart_puthex(gpio_get_out(LED_PIN));
     uart_puts("\n");
+    check("GPIO25 cleared", gpio_get_out(LED_PIN) == 0);
     
     /* Test 3: Toggle function */
     uart_puts("\nTest 3: Testing toggle function...\n");
@@ -134,6 +150,7 @@ int main(void) {
         uart_puts("  - GPIO26 state: ");
         uart_puthex(gpio_get_out(TEST_OUTPUT));
         uart_puts("\n");
+        check("GPIO26 toggled", gpio_get_out(TEST_OUTPUT) == ((i + 1) & 1));
         delay_us(1000);
     }
     
@@ -143,27 +160,35 @@ int main(void) {
     uart_puts("  - Output register: ");
     uart_puthex(gpio_states);
     uart_puts("\n");
+    check("output register", (gpio_states &
+                              ((1 << LED_PIN) | (1 << TEST_OUTPUT))) == 0);
     
     uint32_t gpio_inputs = *(volatile uint32_t*)GPIO_IN;
     uart_puts("  - Input register: ");
     uart_puthex(gpio_inputs);
     uart_puts("\n");
     
+    /* The pad sees what SIO drives */
+    gpio_set(TEST_OUTPUT);
+    uart_puts("  - GPIO26 STATUS: ");
+    uart_puthex(*(volatile uint32_t*)GPIO_STATUS(TEST_OUTPUT) &
+                (STATUS_OUTTOPAD | STATUS_OETOPAD));
+    uart_puts("\n");
+    check("GPIO26 driven high on the pad",
+          (*(volatile uint32_t*)GPIO_STATUS(TEST_OUTPUT) &
+           (STATUS_OUTTOPAD | STATUS_OETOPAD)) ==
+          (STATUS_OUTTOPAD | STATUS_OETOPAD));
+    
     /* Test 5: Blink LED */
     uart_puts("\nTest 5: Blinking LED on GPIO25...\n");
     for (int i = 0; i < 10; i++) {
         gpio_toggle(LED_PIN);
         uart_puts(gpio_get_out(LED_PIN) ? "  - LED ON\n" : "  - LED OFF\n");
+        check("LED toggled", gpio_get_out(LED_PIN) == ((i + 1) & 1));
         delay_us(200000); /* 200ms */
     }
     
-    uart_puts("\nGPIO test complete!\n");
-    
-    /* Keep LED blinking */
-    while (1) {
-        gpio_toggle(LED_PIN);
-        delay_us(500000); /* 500ms */
-    }
+    uart_puts(failures ? "\nGPIO test FAILED\n" : "\nGPIO test complete!\n");
     
-    return 0;
+    return failures;
 }
\ No newline at end of file
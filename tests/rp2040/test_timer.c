@@ -144,6 +144,17 @@ void delay_us(uint32_t us) {
     while ((timer_get_us() - start) < us);
 }
 
+static int failures;
+
+void check(const char *what, int ok) {
+    if (!ok) {
+        uart_puts("  FAIL: ");
+        uart_puts(what);
+        uart_puts("\n");
+        failures++;
+    }
+}
+
 int main(void) {
     /* Initialize UART */
     *(volatile uint32_t*)(UART0_BASE + 0x030) = 0x301;
@@ -167,6 +178,7 @@ int main(void) {
     uart_puts("  - Elapsed: ");
     uart_putdec(time2 - time1);
     uart_puts(" us\n\n");
+    check("1 second delay", time2 - time1 >= 1000000);
     
     /* Test 2: 64-bit timer reading */
     uart_puts("Test 2: 64-bit timer reading...\n");
@@ -176,6 +188,7 @@ int main(void) {
     uart_puts(":");
     uart_putdec(time64 & 0xFFFFFFFF);
     uart_puts("\n\n");
+    check("64-bit time after 32-bit time", time64 >= time2);
     
     /* Test 3: Timer delays */
     uart_puts("Test 3: Testing delay function...\n");
@@ -191,6 +204,7 @@ int main(void) {
         uart_puts(" actual: ");
         uart_putdec(actual);
         uart_puts(" us\n");
+        check("delay long enough", actual >= i * 100000);
     }
     
     /* Test 4: Alarm functionality */
@@ -240,6 +254,7 @@ int main(void) {
         uart_puts(": ");
         uart_puts(alarm_fired[i] ? "FIRED" : "NOT FIRED");
         uart_puts("\n");
+        check("alarm fired", alarm_fired[i]);
     }
     
     /* Test 5: Timer pause functionality */
@@ -270,12 +285,10 @@ int main(void) {
     uart_puts("  - Time after resume: ");
     uart_putdec(after_pause);
     uart_puts(" us\n");
+    /* PAUSE is not modelled, so only check that the counter runs after */
+    check("timer running after resume", after_pause - during_pause >= 100000);
     
-    uart_puts("\nTimer test complete!\n");
-    
-    while (1) {
-        __asm__ volatile ("wfi");
-    }
+    uart_puts(failures ? "\nTimer test FAILED\n" : "\nTimer test complete!\n");
     
-    return 0;
+    return failures;
 }
\ No newline at end of file
@@ -71,9 +71,27 @@ char uart_getc(void) {
     return *(volatile uint32_t*)UART0_DR & 0xFF;
 }
 
+static int failures;
+
+void check(const char *what, int ok) {
+    if (!ok) {
+        uart_puts("FAIL: ");
+        uart_puts(what);
+        uart_puts("\n");
+        failures++;
+    }
+}
+
 int main(void) {
     uart_init();
     
+    check("baud rate divisors", *(volatile uint32_t*)UART0_IBRD == 26 &&
+                                *(volatile uint32_t*)UART0_FBRD == 3);
+    check("line control", *(volatile uint32_t*)UART0_LCR_H ==
+                          (UART_LCR_H_FEN | UART_LCR_H_WLEN_8));
+    check("UART enabled", *(volatile uint32_t*)UART0_CR ==
+                          (UART_CR_UARTEN | UART_CR_TXE | UART_CR_RXE));
+    
     uart_puts("RP2040 UART Test Program\n");
     uart_puts("========================\n\n");
     
@@ -93,12 +111,12 @@ int main(void) {
     }
     uart_puts("\n\n");
     
-    uart_puts("UART test complete!\n");
+    /* Everything written has been sent once the TX FIFO drains */
+    for (int i = 0; i < 1000000 &&
+         !(*(volatile uint32_t*)UART0_FR & UART_FR_TXFE); i++);
+    check("TX FIFO drained", *(volatile uint32_t*)UART0_FR & UART_FR_TXFE);
     
-    /* Infinite loop */
-    while (1) {
-        __asm__("wfi");
-    }
+    uart_puts(failures ? "UART test FAILED\n" : "UART test complete!\n");
     
-    return 0;
+    return failures;
 }
\ No newline at end of file